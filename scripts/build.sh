@@ -7,7 +7,19 @@ ROOT_DIR=$(realpath $SCRIPT_DIR/..)
 echo "Got root of directory: $ROOT_DIR"
 mkdir -p $ROOT_DIR/build
 
-c_params="-O3 -Wall -std=c++20 -I $ROOT_DIR/src/include"
+c_params="-O3 -Wall -pthread -std=c++20 -I $ROOT_DIR/src/include"
+c_libs="-lz"
+if echo "#include <zstd.h>" | g++ -E -x c++ - &> /dev/null; then
+    c_libs="$c_libs -lzstd"
+fi
+
+# Parallel algorithms of libstdc++ run on TBB when it is installed
+pybind_libs=""
+if echo "#include <tbb/version.h>" | g++ -E -x c++ - &> /dev/null; then
+    c_libs="$c_libs -ltbb"
+    pybind_libs="-ltbb"
+fi
+
 pybind_params="-O3 -Wall -fvisibility=hidden -shared -std=c++20 -fPIC $(python3-config --includes) -I $ROOT_DIR/src/include -I $ROOT_DIR/extern/pybind11/include"
 pybind_extension=$(python3-config --extension-suffix)
 
@@ -23,5 +35,6 @@ execute() {
     fi
 }
 
-execute "g++ $pybind_params $ROOT_DIR/src/core/c_utils.cpp -o $ROOT_DIR/src/core/c_utils$pybind_extension"
-execute "g++ $c_params $ROOT_DIR/src/learn.cpp -o $ROOT_DIR/build/learn.exe"
+execute "g++ $pybind_params $ROOT_DIR/src/core/c_utils.cpp -o $ROOT_DIR/src/core/c_utils$pybind_extension $pybind_libs"
+execute "g++ $c_params $ROOT_DIR/src/learn.cpp -o $ROOT_DIR/build/learn.exe $c_libs"
+execute "g++ $c_params $ROOT_DIR/src/server.cpp -o $ROOT_DIR/build/server.exe $c_libs"
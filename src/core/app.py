@@ -1,12 +1,15 @@
 from __future__ import annotations
 
+import asyncio
+import json
 from pathlib import Path
-from typing import Any, Callable, TypeVar, TYPE_CHECKING
+from typing import Any, Callable, Optional, TypeVar, TYPE_CHECKING
 
 from aiohttp import web
 from multidict import MultiDictProxy
 
-from .c_utils import inference
+from .batching import MicroBatcher
+from .c_utils import inference_async
 
 
 __all__ = ("Application",)
@@ -29,12 +32,36 @@ def _extract_form_key(
         raise web.HTTPBadRequest
 
 
+def _complete(future: asyncio.Future[str], result: Optional[str], error: Optional[str]) -> None:
+    if future.cancelled():
+        return
+
+    if result is None:
+        future.set_exception(RuntimeError(error))
+    else:
+        future.set_result(result)
+
+
+async def _inference(text: str, **kwargs: Any) -> str:
+    """Run `inference` on the native worker pool, without blocking the event loop"""
+    loop = asyncio.get_running_loop()
+    future = loop.create_future()
+
+    def callback(result: Optional[str], error: Optional[str]) -> None:
+        # Called from a native worker thread
+        loop.call_soon_threadsafe(_complete, future, result, error)
+
+    inference_async(text, callback, **kwargs)
+    return await future
+
+
 class Application(web.Application):
 
     if TYPE_CHECKING:
         edit_distance_threshold: int
         max_candidates_per_token: int
         edit_penalty_factor: float
+        batcher: Optional[MicroBatcher]
 
     def __init__(
         self,
@@ -42,17 +69,21 @@ class Application(web.Application):
         edit_distance_threshold: int,
         max_candidates_per_token: int,
         edit_penalty_factor: float,
+        batch_window: float = 0.0,
+        max_batch_size: int = 1,
     ) -> None:
         super().__init__()
 
         self.edit_distance_threshold = edit_distance_threshold
         self.max_candidates_per_token = max_candidates_per_token
         self.edit_penalty_factor = edit_penalty_factor
+        self.batcher = MicroBatcher(window=batch_window, max_batch_size=max_batch_size) if max_batch_size > 1 else None
 
         self.add_routes(
             [
                 web.get("/", self._root),
                 web.post("/api", self._api),
+                web.get("/api/stats", self._stats),
             ],
         )
 
@@ -79,11 +110,18 @@ class Application(web.Application):
         if edit_distance_threshold < 0 or max_candidates_per_token < 0 or edit_penalty_factor < 0.0 or edit_penalty_factor > 1.0:
             raise web.HTTPBadRequest
 
+        inference = _inference if self.batcher is None else self.batcher.inference
         return web.Response(
-            text=inference(
+            text=await inference(
                 text,
                 edit_distance_threshold=edit_distance_threshold,
                 max_candidates_per_token=max_candidates_per_token,
                 edit_penalty_factor=edit_penalty_factor,
             ),
         )
+
+    async def _stats(self, request: web.Request) -> web.Response:
+        return web.Response(
+            text=json.dumps({} if self.batcher is None else self.batcher.stats),
+            content_type="application/json",
+        )
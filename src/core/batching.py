@@ -0,0 +1,148 @@
+from __future__ import annotations
+
+import asyncio
+from typing import Any, Dict, List, Optional, Tuple
+
+from .c_utils import inference_batch_async
+
+
+__all__ = ("MicroBatcher",)
+
+
+_Key = Tuple[int, int, float]
+
+
+def _complete(future: asyncio.Future[str], result: Optional[str], error: Optional[str]) -> None:
+    if future.cancelled():
+        return
+
+    if result is None:
+        future.set_exception(RuntimeError(error))
+    else:
+        future.set_result(result)
+
+
+class MicroBatcher:
+    """Coalesce concurrent inference requests into a single native batch call
+
+    Requests with the same parameters are queued until `window` seconds after the first one, or
+    until `max_batch_size` of them are waiting, then run with `inference_batch_async`. Each request
+    is answered as soon as its own text is corrected, without waiting for the rest of its batch.
+    """
+
+    __slots__ = (
+        "window",
+        "max_batch_size",
+        "_queues",
+        "_timers",
+        "_queue_depth",
+        "_max_queue_depth",
+        "_in_flight",
+        "_batch_count",
+        "_request_count",
+        "_last_batch_size",
+        "_max_batch_size_seen",
+    )
+
+    def __init__(self, *, window: float, max_batch_size: int) -> None:
+        self.window = window
+        self.max_batch_size = max_batch_size
+
+        self._queues: Dict[_Key, List[Tuple[str, asyncio.Future[str]]]] = {}
+        self._timers: Dict[_Key, asyncio.TimerHandle] = {}
+
+        self._queue_depth = 0
+        self._max_queue_depth = 0
+        self._in_flight = 0
+        self._batch_count = 0
+        self._request_count = 0
+        self._last_batch_size = 0
+        self._max_batch_size_seen = 0
+
+    @property
+    def stats(self) -> Dict[str, Any]:
+        """Queue depth and batch size statistics"""
+        return {
+            "queue_depth": self._queue_depth,
+            "max_queue_depth": self._max_queue_depth,
+            "in_flight": self._in_flight,
+            "batch_count": self._batch_count,
+            "request_count": self._request_count,
+            "last_batch_size": self._last_batch_size,
+            "max_batch_size": self._max_batch_size_seen,
+            "mean_batch_size": self._request_count / self._batch_count if self._batch_count > 0 else 0.0,
+        }
+
+    async def inference(
+        self,
+        text: str,
+        *,
+        edit_distance_threshold: int,
+        max_candidates_per_token: int,
+        edit_penalty_factor: float,
+    ) -> str:
+        loop = asyncio.get_running_loop()
+        future = loop.create_future()
+
+        key = (edit_distance_threshold, max_candidates_per_token, edit_penalty_factor)
+        queue = self._queues.setdefault(key, [])
+        queue.append((text, future))
+
+        self._queue_depth += 1
+        self._max_queue_depth = max(self._max_queue_depth, self._queue_depth)
+
+        if len(queue) >= self.max_batch_size:
+            self._flush(key)
+        elif key not in self._timers:
+            self._timers[key] = loop.call_later(self.window, self._flush, key)
+
+        return await future
+
+    def _flush(self, key: _Key) -> None:
+        timer = self._timers.pop(key, None)
+        if timer is not None:
+            timer.cancel()
+
+        queue = self._queues.pop(key, [])
+        if len(queue) == 0:
+            return
+
+        texts = [text for text, _ in queue]
+        futures = [future for _, future in queue]
+
+        self._queue_depth -= len(queue)
+        self._in_flight += len(queue)
+        self._batch_count += 1
+        self._request_count += len(queue)
+        self._last_batch_size = len(queue)
+        self._max_batch_size_seen = max(self._max_batch_size_seen, len(queue))
+
+        loop = asyncio.get_running_loop()
+
+        # A failed call may still report the texts it handled before failing
+        pending = [True] * len(futures)
+
+        def done(index: int, result: Optional[str], error: Optional[str]) -> None:
+            if pending[index]:
+                pending[index] = False
+                self._in_flight -= 1
+                _complete(futures[index], result, error)
+
+        def callback(index: int, result: Optional[str], error: Optional[str]) -> None:
+            # Called from a native worker thread, or directly for empty texts
+            loop.call_soon_threadsafe(done, index, result, error)
+
+        edit_distance_threshold, max_candidates_per_token, edit_penalty_factor = key
+        try:
+            inference_batch_async(
+                texts,
+                callback,
+                edit_distance_threshold=edit_distance_threshold,
+                max_candidates_per_token=max_candidates_per_token,
+                edit_penalty_factor=edit_penalty_factor,
+            )
+
+        except Exception as e:
+            for index in range(len(futures)):
+                done(index, None, str(e))
+
@@ -1,4 +1,12 @@
-def initialize(*, frequency_path: str, wordlist_path: str) -> None: ...
+from typing import Callable, List, Optional
+
+
+def initialize(
+    *,
+    frequency_path: Optional[str] = None,
+    wordlist_path: Optional[str] = None,
+    model_path: Optional[str] = None,
+) -> None: ...
 
 
 def inference(
@@ -8,3 +16,32 @@ def inference(
     max_candidates_per_token: int,
     edit_penalty_factor: float,
 ) -> str: ...
+
+
+def inference_batch(
+    inputs: List[str],
+    *,
+    edit_distance_threshold: int,
+    max_candidates_per_token: int,
+    edit_penalty_factor: float,
+) -> List[str]: ...
+
+
+def inference_async(
+    input: str,
+    callback: Callable[[Optional[str], Optional[str]], None],
+    *,
+    edit_distance_threshold: int,
+    max_candidates_per_token: int,
+    edit_penalty_factor: float,
+) -> None: ...
+
+
+def inference_batch_async(
+    inputs: List[str],
+    callback: Callable[[int, Optional[str], Optional[str]], None],
+    *,
+    edit_distance_threshold: int,
+    max_candidates_per_token: int,
+    edit_penalty_factor: float,
+) -> None: ...
@@ -3,96 +3,335 @@
 #include "distance.hpp"
 #include "utils.hpp"
 
-class __BKTreeNode
+/**
+ * @brief A read-only BK-tree over the tokens of a model, in a flat layout.
+ *
+ * Nodes are numbered in breadth-first order with the root at `0`, so that the children of a node
+ * form a contiguous range of nodes, sorted by their distance to the parent. Each node stores its
+ * token, its distance to its parent and the offset of its first child.
+ *
+ * The optimal string alignment distance does not strictly satisfy the triangle inequality (e.g.
+ * "ca", "ac" and "abc"), so a search may rarely miss a match that edits between transposed
+ * characters.
+ *
+ * @see https://en.wikipedia.org/wiki/BK-tree
+ */
+class BKTree
 {
+private:
+    std::span<const uint32_t> _tokens;
+    std::span<const uint32_t> _distances;
+    std::span<const uint32_t> _offsets;
+
 public:
-    std::string word;
-    std::map<std::size_t, __BKTreeNode *> children;
+    BKTree() = default;
 
-    __BKTreeNode(const std::string &w) : word(w) {}
-    ~__BKTreeNode()
+    /**
+     * @param tokens The token of each node.
+     * @param distances The distance from each node to its parent.
+     * @param offsets The range of children of each node, `node_count + 1` elements.
+     */
+    BKTree(std::span<const uint32_t> tokens, std::span<const uint32_t> distances, std::span<const uint32_t> offsets)
+        : _tokens(tokens), _distances(distances), _offsets(offsets) {}
+
+    std::size_t size() const
     {
-        for (auto &[_, child] : children)
-        {
-            delete child;
-        }
+        return _tokens.size();
     }
-};
 
-class BKTree
-{
-private:
-    __BKTreeNode *_root = nullptr;
+    bool empty() const
+    {
+        return _tokens.empty();
+    }
 
-public:
-    template <typename _InputIter, utils::is_input_iterator_t<_InputIter> = true>
-    BKTree(_InputIter __first, _InputIter __last)
+    /**
+     * @brief Check that the arrays form a tree, so that searches stay in bounds.
+     */
+    bool valid() const
     {
-        for (; __first != __last; __first++)
+        if (_distances.size() != size() || _offsets.size() != (empty() ? 0 : size() + 1))
+        {
+            return false;
+        }
+
+        for (std::size_t i = 0; i < size(); i++)
+        {
+            // Children come after their parent in breadth-first order
+            if (_offsets[i] > _offsets[i + 1] || (_offsets[i] < _offsets[i + 1] && _offsets[i] <= i))
+            {
+                return false;
+            }
+        }
+
+        if (!empty() && _offsets.back() > size())
         {
-            add(*__first);
+            return false;
         }
+
+        return true;
     }
 
-    ~BKTree()
+    /**
+     * @brief Find the tokens within edit distance `max_distance` of a string.
+     *
+     * @param query The characters of the string.
+     * @param max_distance The maximum edit distance.
+     * @param characters The characters of each token, e.g. `Model::characters`.
+     * @param results The vector to write the indices of the tokens to, in no particular order.
+     */
+    template <typename _Characters>
+    void search(
+        std::span<const uint32_t> query,
+        std::size_t max_distance,
+        const _Characters &characters,
+        std::vector<uint32_t> &results) const
     {
-        delete _root;
+        results.clear();
+        if (empty())
+        {
+            return;
+        }
+
+        thread_local std::vector<uint32_t> stack;
+        stack.assign(1, 0);
+        while (!stack.empty())
+        {
+            const auto node = stack.back();
+            stack.pop_back();
+
+            const auto begin = _distances.begin() + _offsets[node], end = _distances.begin() + _offsets[node + 1];
+
+            // Children further than `max_distance` from the largest key can never be searched
+            const std::size_t bound = max_distance + (begin == end ? 0 : *(end - 1));
+            const auto d = damerau_levenshtein(query, characters[_tokens[node]], bound);
+            if (d <= max_distance)
+            {
+                results.push_back(_tokens[node]);
+            }
+
+            // By the triangle inequality, only children at distance `d +- max_distance` may match
+            auto iter = std::lower_bound(begin, end, d > max_distance ? d - max_distance : 0);
+            for (; iter != end && *iter <= d + max_distance; iter++)
+            {
+                stack.push_back(iter - _distances.begin());
+            }
+        }
     }
 
-    void add(const std::string &word)
+    /**
+     * @brief Find the tokens within edit distance `max_distance` of each of many strings, in a
+     * single traversal of the tree.
+     *
+     * Each node is visited once with the queries that may still match in its subtree, and their
+     * distances to it are computed with the batch kernel. Results are the same as with `search`
+     * for each query. Queries are independent, so a large batch can also be split into chunks
+     * searched on different threads.
+     *
+     * @param queries The characters of each string.
+     * @param max_distance The maximum edit distance.
+     * @param characters The characters of each token, e.g. `Model::characters`.
+     * @param results The vector to write the indices of the tokens for each query to, in no
+     * particular order.
+     */
+    template <typename _Characters>
+    void search(
+        const std::vector<std::span<const uint32_t>> &queries,
+        std::size_t max_distance,
+        const _Characters &characters,
+        std::vector<std::vector<uint32_t>> &results) const
     {
-        if (_root == nullptr)
+        results.resize(queries.size());
+        for (auto &result : results)
+        {
+            result.clear();
+        }
+
+        if (empty() || queries.empty())
         {
-            _root = new __BKTreeNode(word);
             return;
         }
 
-        __BKTreeNode *current = _root;
-        while (true)
+        // The active queries of the nodes on the stack are ranges of `ids`, in the same order
+        thread_local std::vector<std::tuple<uint32_t, std::size_t, std::size_t>> stack;
+        thread_local std::vector<uint32_t> ids, active;
+        thread_local std::vector<std::span<const uint32_t>> texts;
+        thread_local std::vector<std::size_t> distances;
+
+        ids.resize(queries.size());
+        std::iota(ids.begin(), ids.end(), 0);
+        stack.assign(1, std::make_tuple(0, 0, ids.size()));
+        while (!stack.empty())
         {
-            std::size_t distance = damerau_levenshtein(current->word, word);
+            const auto [node, first, last] = stack.back();
+            stack.pop_back();
+
+            active.assign(ids.begin() + first, ids.begin() + last);
+            ids.resize(first);
+
+            texts.clear();
+            for (auto query : active)
+            {
+                texts.push_back(queries[query]);
+            }
 
-            if (current->children.find(distance) == current->children.end())
+            const auto token = _tokens[node];
+            damerau_levenshtein(characters[token], texts, distances);
+            for (std::size_t j = 0; j < active.size(); j++)
             {
-                current->children[distance] = new __BKTreeNode(word);
-                break;
+                if (distances[j] <= max_distance)
+                {
+                    results[active[j]].push_back(token);
+                }
             }
 
-            current = current->children[distance];
+            // By the triangle inequality, a query may only match under children at distance `d +- max_distance`
+            for (auto child = _offsets[node]; child < _offsets[node + 1]; child++)
+            {
+                const std::size_t key = _distances[child], begin = ids.size();
+                for (std::size_t j = 0; j < active.size(); j++)
+                {
+                    if (key + max_distance >= distances[j] && key <= distances[j] + max_distance)
+                    {
+                        ids.push_back(active[j]);
+                    }
+                }
+
+                if (ids.size() > begin)
+                {
+                    stack.emplace_back(child, begin, ids.size());
+                }
+            }
         }
     }
+};
+
+/**
+ * @brief Build the arrays of a `BKTree` over all tokens.
+ *
+ * The tree is built level by level: the first token of a subtree becomes its root, and the other
+ * ones are grouped into child subtrees by their distance to it. Distances of a level are computed in
+ * parallel with the batch kernel.
+ *
+ * @param characters The characters of each token, indexed by token.
+ * @param tokens The vector to write the token of each node to.
+ * @param distances The vector to write the distance from each node to its parent to.
+ * @param offsets The vector to write the range of children of each node to.
+ */
+template <typename _Characters>
+void build_bk_tree(
+    const _Characters &characters,
+    std::vector<uint32_t> &tokens,
+    std::vector<uint32_t> &distances,
+    std::vector<uint32_t> &offsets)
+{
+    const std::size_t token_count = characters.size();
+    tokens.clear();
+    distances.clear();
+    offsets.clear();
+    if (token_count == 0)
+    {
+        return;
+    }
 
-    std::vector<std::string> search(const std::string &query, std::size_t max_distance) const
+    if (token_count > std::numeric_limits<uint32_t>::max())
     {
-        // std::cerr << "query = \"" << query << "\"" << std::endl;
-        std::vector<std::string> results;
-        if (_root != nullptr)
+        throw std::overflow_error("Too many tokens for a BK-tree");
+    }
+
+    // The members of the subtrees of the current level, in node order: the first member of each
+    // subtree is its root
+    std::vector<uint32_t> members(token_count), next_members;
+    std::iota(members.begin(), members.end(), 0);
+    std::vector<std::size_t> bounds = {0, token_count}, next_bounds;
+
+    // The distance of each member to the root of its subtree
+    std::vector<uint32_t> keys(token_count);
+
+    tokens.push_back(members[0]);
+    distances.push_back(0);
+
+    constexpr std::size_t CHUNK_SIZE = 1 << 12;
+    while (bounds.size() > 1)
+    {
+        // Split the members of the level into chunks within a single subtree
+        std::vector<std::pair<std::size_t, std::size_t>> chunks; // (subtree, first member)
+        for (std::size_t s = 0; s + 1 < bounds.size(); s++)
         {
-            std::vector<std::pair<__BKTreeNode *, bool>> stack = {std::make_pair(_root, false)};
-            while (!stack.empty())
+            for (auto i = bounds[s] + 1; i < bounds[s + 1]; i += CHUNK_SIZE)
+            {
+                chunks.emplace_back(s, i);
+            }
+        }
+
+        std::for_each(
+            std::execution::par, chunks.begin(), chunks.end(),
+            [&](const std::pair<std::size_t, std::size_t> &chunk)
             {
-                auto [ptr, prune] = stack.back();
-                stack.pop_back();
+                const auto [s, first] = chunk;
+                const auto last = std::min(bounds[s + 1], first + CHUNK_SIZE);
+
+                thread_local std::vector<std::span<const uint32_t>> texts;
+                thread_local std::vector<std::size_t> result;
 
-                auto d = damerau_levenshtein(query, ptr->word);
-                // std::cerr << "Searching at \"" << ptr->word << "\" with distance = " << d << ", prune = " << prune << std::endl;
-                if (d <= max_distance)
+                texts.clear();
+                for (auto i = first; i < last; i++)
                 {
-                    results.push_back(ptr->word);
-                    prune = true;
+                    texts.push_back(characters[members[i]]);
                 }
 
-                for (auto &[d_child, child] : ptr->children)
+                damerau_levenshtein(characters[members[bounds[s]]], texts, result);
+                std::copy(result.begin(), result.end(), keys.begin() + first);
+            });
+
+        // Group the members of each subtree by their distance to its root, keeping their order
+        std::vector<uint32_t> order(members.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::vector<std::size_t> subtrees(bounds.size() - 1);
+        std::iota(subtrees.begin(), subtrees.end(), 0);
+        std::for_each(
+            std::execution::par, subtrees.begin(), subtrees.end(),
+            [&](std::size_t s)
+            {
+                std::stable_sort(
+                    order.begin() + bounds[s] + 1, order.begin() + bounds[s + 1],
+                    [&keys](uint32_t lhs, uint32_t rhs)
+                    { return keys[lhs] < keys[rhs]; });
+            });
+
+        // Roots of the child subtrees become the nodes of the next level, in breadth-first order
+        next_members.clear();
+        next_bounds.assign(1, 0);
+        for (std::size_t s = 0; s + 1 < bounds.size(); s++)
+        {
+            offsets.push_back(tokens.size());
+            for (auto i = bounds[s] + 1; i < bounds[s + 1]; i++)
+            {
+                const auto member = order[i];
+                if (i == bounds[s] + 1 || keys[member] != keys[order[i - 1]])
                 {
-                    auto diff = d_child > d ? d_child - d : d - d_child;
-                    if (diff < max_distance || !prune)
+                    if (i > bounds[s] + 1)
                     {
-                        stack.emplace_back(child, prune);
+                        next_bounds.push_back(next_members.size());
                     }
+
+                    tokens.push_back(members[member]);
+                    distances.push_back(keys[member]);
                 }
+
+                next_members.push_back(members[member]);
+            }
+
+            if (bounds[s] + 1 < bounds[s + 1])
+            {
+                next_bounds.push_back(next_members.size());
             }
         }
 
-        return results;
+        members.swap(next_members);
+        bounds.swap(next_bounds);
+        keys.resize(members.size());
     }
-};
+
+    // Leaves of the last level have no children
+    offsets.resize(tokens.size() + 1, tokens.size());
+}
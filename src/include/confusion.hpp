@@ -0,0 +1,122 @@
+#pragma once
+
+#include "delete_index.hpp"
+#include "distance.hpp"
+#include "utils.hpp"
+
+/**
+ * @brief Read-only confusion sets: for each token, the other tokens within a fixed edit distance
+ * of it, sorted by index, with their distances.
+ */
+class ConfusionSets
+{
+private:
+    uint32_t _distance = 0;
+    std::span<const uint64_t> _offsets;
+    std::span<const uint32_t> _tokens;
+    std::span<const uint8_t> _distances;
+
+public:
+    ConfusionSets() = default;
+    ConfusionSets(uint32_t distance, std::span<const uint64_t> offsets, std::span<const uint32_t> tokens, std::span<const uint8_t> distances)
+        : _distance(distance), _offsets(offsets), _tokens(tokens), _distances(distances) {}
+
+    /**
+     * @brief The maximum edit distance of the confusion sets.
+     */
+    std::size_t distance() const
+    {
+        return _distance;
+    }
+
+    bool empty() const
+    {
+        return _offsets.empty();
+    }
+
+    /**
+     * @brief The edit distance between 2 tokens.
+     *
+     * @return The distance if it does not exceed `distance()`, otherwise `distance() + 1`.
+     */
+    std::size_t distance(uint32_t token, uint32_t other) const
+    {
+        if (token == other)
+        {
+            return 0;
+        }
+
+        const auto begin = _tokens.begin() + _offsets[token], end = _tokens.begin() + _offsets[token + 1];
+        const auto iter = std::lower_bound(begin, end, other);
+        return iter != end && *iter == other ? _distances[iter - _tokens.begin()] : _distance + 1;
+    }
+};
+
+/**
+ * @brief Build the arrays of `ConfusionSets`, in parallel over tokens.
+ *
+ * @param characters The characters of each token, indexed by token.
+ * @param index A delete index over the same tokens, with a distance of at least `distance`.
+ * @param distance The maximum edit distance, at most `255`.
+ * @param offsets The vector to write the range of the confusion set of each token to.
+ * @param tokens The vector to write the tokens of each confusion set to.
+ * @param distances The vector to write the distance to each token of each confusion set to.
+ */
+template <typename _Characters>
+void build_confusion_sets(
+    const _Characters &characters,
+    const DeleteIndex &index,
+    std::size_t distance,
+    std::vector<uint64_t> &offsets,
+    std::vector<uint32_t> &tokens,
+    std::vector<uint8_t> &distances)
+{
+    if (distance > std::min<std::size_t>(index.distance(), std::numeric_limits<uint8_t>::max()))
+    {
+        throw std::invalid_argument(utils::format("Cannot build confusion sets of distance %zu", distance));
+    }
+
+    const std::size_t token_count = characters.size();
+    std::vector<std::vector<std::pair<uint32_t, uint8_t>>> sets(token_count);
+    std::vector<uint32_t> indices(token_count);
+    std::iota(indices.begin(), indices.end(), 0);
+    std::for_each(
+        std::execution::par, indices.begin(), indices.end(),
+        [&](uint32_t token)
+        {
+            thread_local std::vector<uint32_t> candidates;
+            thread_local std::vector<std::span<const uint32_t>> texts;
+            thread_local std::vector<std::size_t> result;
+
+            index.lookup(characters[token], distance, candidates);
+
+            texts.clear();
+            for (auto candidate : candidates)
+            {
+                texts.push_back(characters[candidate]);
+            }
+
+            damerau_levenshtein(characters[token], texts, result);
+            for (std::size_t i = 0; i < candidates.size(); i++)
+            {
+                if (result[i] <= distance && candidates[i] != token)
+                {
+                    sets[token].emplace_back(candidates[i], result[i]);
+                }
+            }
+        });
+
+    offsets.assign(1, 0);
+    tokens.clear();
+    distances.clear();
+    for (const auto &set : sets)
+    {
+        for (const auto &[other, d] : set)
+        {
+            tokens.push_back(other);
+            distances.push_back(d);
+        }
+
+        offsets.push_back(tokens.size());
+    }
+}
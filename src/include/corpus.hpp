@@ -0,0 +1,602 @@
+#pragma once
+
+#include "data.hpp"
+#include "decompress.hpp"
+#include "flat_map.hpp"
+#include "sketch.hpp"
+#include "utils.hpp"
+
+/**
+ * @brief Bigrams with a count below this threshold are discarded from the model.
+ */
+constexpr unsigned int FREQUENCY_THRESHOLD = 4;
+
+/**
+ * @brief The maximum number of run files opened at once by a merge.
+ */
+constexpr std::size_t MAX_MERGED_RUNS = 256;
+
+/**
+ * @brief Sequential writer of a run file, i.e. bigram counts sorted by mask.
+ */
+class RunWriter
+{
+private:
+    std::string _path;
+    std::fstream _output;
+
+public:
+    RunWriter(const std::string &path) : _path(path), _output(path, std::ios::out | std::ios::binary) {}
+
+    /**
+     * @brief Flush and close the run file, reporting any write error. Must be called once all
+     * entries are written, the destructor closes the file without checking.
+     */
+    void close()
+    {
+        _output.close();
+        if (!_output)
+        {
+            throw std::runtime_error(utils::format("Failed to write \"%s\"", _path.c_str()));
+        }
+    }
+
+    void write(uint64_t mask, unsigned int freq)
+    {
+        _output.write(reinterpret_cast<const char *>(&mask), sizeof(mask));
+        _output.write(reinterpret_cast<const char *>(&freq), sizeof(freq));
+    }
+};
+
+/**
+ * @brief Sequential reader of a run file written by `RunWriter`.
+ */
+class RunReader
+{
+private:
+    std::vector<char> _buffer;
+    std::fstream _input;
+
+public:
+    uint64_t mask = 0;
+    unsigned int freq = 0;
+
+    RunReader(const std::string &path) : _buffer(1 << 16)
+    {
+        // The buffer must be set before opening the file
+        _input.rdbuf()->pubsetbuf(_buffer.data(), _buffer.size());
+        _input.open(path, std::ios::in | std::ios::binary);
+        if (!_input)
+        {
+            throw std::runtime_error(utils::format("Failed to read \"%s\"", path.c_str()));
+        }
+    }
+
+    /**
+     * @brief Read the next entry into `mask` and `freq`.
+     *
+     * @return Whether an entry was read.
+     */
+    bool next()
+    {
+        return _input.read(reinterpret_cast<char *>(&mask), sizeof(mask)) && _input.read(reinterpret_cast<char *>(&freq), sizeof(freq));
+    }
+};
+
+/**
+ * @brief K-way merge of run files, summing the counts of identical bigrams.
+ *
+ * The run files are deleted afterwards.
+ *
+ * @param paths The paths to the run files.
+ * @param callback The function to call with each bigram mask and its total count, in sorted order.
+ */
+template <typename _Callback>
+void merge_runs(const std::vector<std::string> &paths, _Callback callback)
+{
+    std::vector<std::unique_ptr<RunReader>> runs;
+    std::priority_queue<std::pair<uint64_t, std::size_t>, std::vector<std::pair<uint64_t, std::size_t>>, std::greater<>> heap;
+    for (std::size_t i = 0; i < paths.size(); i++)
+    {
+        runs.push_back(std::make_unique<RunReader>(paths[i]));
+        if (runs[i]->next())
+        {
+            heap.emplace(runs[i]->mask, i);
+        }
+    }
+
+    while (!heap.empty())
+    {
+        const auto mask = heap.top().first;
+        unsigned int freq = 0;
+        while (!heap.empty() && heap.top().first == mask)
+        {
+            const auto i = heap.top().second;
+            heap.pop();
+
+            freq += runs[i]->freq;
+            if (runs[i]->next())
+            {
+                heap.emplace(runs[i]->mask, i);
+            }
+        }
+
+        callback(mask, freq);
+    }
+
+    runs.clear();
+    for (const auto &path : paths)
+    {
+        std::filesystem::remove(path);
+    }
+}
+
+/**
+ * @brief Bigram counter over a contiguous part of the corpus.
+ *
+ * Tokens are grouped until a punctuation mark is met, then every pair of adjacent tokens
+ * in the group is counted. The last group of a counter is kept pending so that counters
+ * of consecutive shards can be merged as if the whole corpus was read by a single one.
+ *
+ * When a Count-Min sketch is attached, a bigram only enters `frequency` once its estimated
+ * count reaches `FREQUENCY_THRESHOLD`, starting from that estimate. Since the sketch never
+ * undercounts, every bigram that would survive the threshold is kept, with a count exceeding
+ * the true one by at most the error bound of the sketch once merged (see `merge_spilled`).
+ *
+ * When spilling is enabled, `frequency` is sorted and written to a run file in `runs` whenever
+ * it reaches the size limit, so that memory usage stays bounded. The runs are later combined
+ * with `merge_runs`.
+ */
+class CorpusCounter
+{
+private:
+    std::vector<uint32_t> _tokens;
+    std::optional<uint32_t> _head;
+    bool _flushed = false;
+
+    // Reused buffer for lowercasing, so that only new tokens are copied into `vocabulary`
+    std::string _buffer;
+
+    // Optional sketch shared between all counters, keyed by `_bigram_hash`
+    CountMinSketch *_sketch;
+    std::vector<uint64_t> _token_hashes;
+
+    // Spilling is disabled if `_spill_limit == 0`
+    std::size_t _spill_limit = 0;
+    std::filesystem::path _spill_directory;
+
+    std::string _next_run_path() const
+    {
+        static std::atomic<std::size_t> counter = 0;
+        return _spill_directory / utils::format("learn-%d-%zu.run", getpid(), counter++);
+    }
+
+    void _check_spill()
+    {
+        if (_spill_limit > 0 && frequency.size() >= _spill_limit)
+        {
+            spill();
+        }
+    }
+
+    uint32_t _tokenize(std::string_view token)
+    {
+        auto index = vocabulary.intern(token);
+        if (_sketch != nullptr && index == _token_hashes.size())
+        {
+            _token_hashes.push_back(std::hash<std::string_view>{}(token));
+        }
+
+        return index;
+    }
+
+    /**
+     * @brief Hash of a bigram based on its strings, so that it does not depend on token indices.
+     */
+    uint64_t _bigram_hash(uint64_t mask) const
+    {
+        return utils::hash64(_token_hashes[mask >> 32] * 0x9e3779b97f4a7c15ULL + _token_hashes[mask & 0xFFFFFFFF]);
+    }
+
+    void _push(uint32_t token)
+    {
+        if (!_flushed && _tokens.empty())
+        {
+            _head = token;
+        }
+
+        _tokens.push_back(token);
+    }
+
+    void _process_tokens()
+    {
+        const auto size = _tokens.size();
+        for (std::size_t i = 0; i + 1 < size; i++)
+        {
+            auto mask = (static_cast<uint64_t>(_tokens[i]) << 32) | _tokens[i + 1];
+            if (_sketch == nullptr)
+            {
+                frequency[mask]++;
+            }
+            else
+            {
+                auto estimate = _sketch->add(_bigram_hash(mask));
+                auto iter = frequency.find(mask);
+                if (iter != frequency.end())
+                {
+                    iter->second++;
+                }
+                else if (estimate >= FREQUENCY_THRESHOLD)
+                {
+                    frequency.emplace(mask, estimate);
+                }
+            }
+        }
+
+        _tokens.clear();
+        _flushed = true;
+
+        _check_spill();
+    }
+
+public:
+    Vocabulary vocabulary;
+    FlatMap<uint64_t, unsigned int> frequency;
+    std::vector<std::string> runs;
+
+    /**
+     * @param reserve The number of elements to reserve in `vocabulary` and `frequency`.
+     * @param sketch An optional Count-Min sketch to bound the number of counted bigrams.
+     */
+    CorpusCounter(std::size_t reserve, CountMinSketch *sketch = nullptr) : _sketch(sketch)
+    {
+        vocabulary.reserve(reserve);
+        frequency.reserve(reserve);
+    }
+
+    /**
+     * @brief Add a token of an existing model.
+     *
+     * Tokens of the existing model must be added in order of their indices before anything else
+     * is fed, so that their indices are preserved.
+     *
+     * @return The index of the token.
+     */
+    uint32_t add_token(std::string_view token)
+    {
+        return _tokenize(token);
+    }
+
+    /**
+     * @brief Add the count of a bigram of an existing model.
+     *
+     * @param mask The bigram `(first << 32) | second`, in indices of this counter.
+     * @param freq The count of the bigram.
+     */
+    void add_frequency(uint64_t mask, unsigned int freq)
+    {
+        frequency[mask] += freq;
+        if (_sketch != nullptr)
+        {
+            _sketch->add(_bigram_hash(mask), freq);
+        }
+
+        _check_spill();
+    }
+
+    /**
+     * @brief Enable spilling of bigram counts to disk.
+     *
+     * @param limit The maximum number of bigrams to hold in memory.
+     * @param directory The directory to write the run files to.
+     */
+    void spill_to(std::size_t limit, const std::filesystem::path &directory)
+    {
+        _spill_limit = std::max<std::size_t>(limit, 1);
+        _spill_directory = directory;
+    }
+
+    /**
+     * @brief Write the bigrams in memory to a new run file and clear them.
+     */
+    void spill()
+    {
+        if (frequency.empty())
+        {
+            return;
+        }
+
+        std::vector<std::pair<uint64_t, unsigned int>> tuples(frequency.begin(), frequency.end());
+        frequency.clear();
+        std::sort(tuples.begin(), tuples.end());
+
+        runs.push_back(_next_run_path());
+        RunWriter writer(runs.back());
+        for (const auto &[mask, freq] : tuples)
+        {
+            writer.write(mask, freq);
+        }
+        writer.close();
+    }
+
+    /**
+     * @brief Spill the remaining bigrams and merge all run files.
+     *
+     * Runs are merged in several passes if there are more than `MAX_MERGED_RUNS` of them.
+     *
+     * With a sketch attached, merged counts are bounded by the estimates of the sketch. A bigram is
+     * admitted again from its estimate after each spill, and each shard admits it from the estimate
+     * of the shared sketch, so the sum may count the occurrences before admission more than once.
+     * Bounding restores the error bound of the sketch.
+     *
+     * @return The bigram counts of at least `FREQUENCY_THRESHOLD`, sorted by mask.
+     */
+    std::vector<std::pair<uint64_t, unsigned int>> merge_spilled()
+    {
+        spill();
+        while (runs.size() > MAX_MERGED_RUNS)
+        {
+            std::vector<std::string> group(runs.begin(), runs.begin() + MAX_MERGED_RUNS);
+            runs.erase(runs.begin(), runs.begin() + MAX_MERGED_RUNS);
+
+            runs.push_back(_next_run_path());
+            RunWriter writer(runs.back());
+            merge_runs(
+                group,
+                [&writer](uint64_t mask, unsigned int freq)
+                { writer.write(mask, freq); });
+            writer.close();
+        }
+
+        // Prune while streaming so that discarded bigrams are never held in memory
+        std::vector<std::pair<uint64_t, unsigned int>> result;
+        merge_runs(
+            runs,
+            [this, &result](uint64_t mask, unsigned int freq)
+            {
+                if (_sketch != nullptr)
+                {
+                    freq = std::min(freq, _sketch->estimate(_bigram_hash(mask)));
+                }
+
+                if (freq >= FREQUENCY_THRESHOLD)
+                {
+                    result.emplace_back(mask, freq);
+                }
+            });
+
+        runs.clear();
+        return result;
+    }
+
+    /**
+     * @brief Feed a whitespace-delimited token from the corpus.
+     *
+     * @param token A non-empty token.
+     */
+    void feed(std::string_view token)
+    {
+        // `token` has at least 1 character
+        bool first_valid = is_tokenizable_char(token.front());
+        bool mid_valid = std::all_of(token.begin() + 1, token.end() - 1, is_tokenizable_char);
+        bool last_valid = is_tokenizable_char(token.back());
+
+        auto mask = (first_valid << 2) | (mid_valid << 1) | last_valid;
+        // std::cerr << "Examining \"" << token << "\", mask = " << first_valid << mid_valid << last_valid << std::endl;
+        if (mask == 0b111)
+        {
+            _buffer.assign(token);
+            utils::to_lower(_buffer);
+            _push(_tokenize(_buffer));
+        }
+        else if (mask == 0b011)
+        {
+            _process_tokens();
+
+            _buffer.assign(token);
+            utils::to_lower(_buffer);
+            _push(_tokenize(std::string_view(_buffer).substr(1)));
+        }
+        else
+        {
+            if (mask == 0b110)
+            {
+                _buffer.assign(token.substr(0, token.size() - 1));
+                utils::to_lower(_buffer);
+
+                _push(_tokenize(_buffer));
+            }
+
+            _process_tokens();
+        }
+    }
+
+    /**
+     * @brief Merge the counter of the next shard into this one.
+     *
+     * Tokens of `shard` are remapped to the indices of this counter in order of first
+     * occurrence, and the group pending at the end of this counter is joined with the
+     * first group of `shard`.
+     *
+     * @param shard The counter of the shard immediately following the data fed to this one.
+     */
+    void merge(const CorpusCounter &shard)
+    {
+        std::vector<uint32_t> remap(shard.vocabulary.size());
+        for (std::size_t i = 0; i < shard.vocabulary.size(); i++)
+        {
+            remap[i] = _tokenize(shard.vocabulary[i]);
+        }
+
+        if (shard._flushed)
+        {
+            // The first group of `shard` has already been counted there, only the pair
+            // crossing the shard boundary is missing.
+            if (shard._head.has_value())
+            {
+                _push(remap[*shard._head]);
+            }
+
+            _process_tokens();
+        }
+
+        for (const auto &token : shard._tokens)
+        {
+            _push(remap[token]);
+        }
+
+        const auto remap_mask = [&remap](uint64_t mask)
+        {
+            return (static_cast<uint64_t>(remap[mask >> 32]) << 32) | remap[mask & 0xFFFFFFFF];
+        };
+
+        for (const auto &[mask, freq] : shard.frequency)
+        {
+            frequency[remap_mask(mask)] += freq;
+            _check_spill();
+        }
+
+        // Runs are sorted by the indices of `shard`, so they must be sorted again after remapping.
+        // Each of them fits in memory since it was spilled from a single table.
+        for (const auto &path : shard.runs)
+        {
+            std::vector<std::pair<uint64_t, unsigned int>> tuples;
+            RunReader reader(path);
+            while (reader.next())
+            {
+                tuples.emplace_back(remap_mask(reader.mask), reader.freq);
+            }
+
+            std::filesystem::remove(path);
+            std::sort(tuples.begin(), tuples.end());
+
+            runs.push_back(_next_run_path());
+            RunWriter writer(runs.back());
+            for (const auto &[mask, freq] : tuples)
+            {
+                writer.write(mask, freq);
+            }
+            writer.close();
+        }
+    }
+};
+
+/**
+ * @brief Split a corpus into byte ranges whose boundaries lie right after a whitespace.
+ *
+ * @param corpus The content of the corpus.
+ * @param count The number of ranges to split into.
+ * @return The `count + 1` boundaries of the ranges.
+ */
+std::vector<std::size_t> split_corpus(std::string_view corpus, std::size_t count)
+{
+    std::vector<std::size_t> boundaries = {0};
+    for (std::size_t i = 1; i < count; i++)
+    {
+        std::size_t position = std::max(boundaries.back(), corpus.size() * i / count);
+        while (position > 0 && position < corpus.size() && !is_whitespace_char(corpus[position - 1]))
+        {
+            position++;
+        }
+
+        boundaries.push_back(position);
+    }
+
+    boundaries.push_back(corpus.size());
+    return boundaries;
+}
+
+/**
+ * @brief Feed all tokens of a corpus range to a counter.
+ *
+ * @param corpus The content of the corpus range, e.g. a view into a memory-mapped file.
+ * @param counter The counter to feed the tokens to.
+ * @param progress The number of bytes read so far, updated periodically.
+ */
+void count_corpus_range(
+    std::string_view corpus,
+    CorpusCounter &counter,
+    std::atomic<long long> &progress)
+{
+    const char *ptr = corpus.data(), *const end = ptr + corpus.size(), *reported = ptr;
+    while (true)
+    {
+        while (ptr != end && is_whitespace_char(*ptr))
+        {
+            ptr++;
+        }
+
+        if (ptr == end)
+        {
+            break;
+        }
+
+        const char *begin = ptr;
+        while (ptr != end && !is_whitespace_char(*ptr))
+        {
+            ptr++;
+        }
+
+        counter.feed(std::string_view(begin, ptr - begin));
+
+        if (ptr - reported >= (1 << 24))
+        {
+            progress += ptr - reported;
+            reported = ptr;
+        }
+    }
+
+    progress += end - reported;
+}
+
+/**
+ * @brief Feed all tokens of a streamed corpus to a counter.
+ *
+ * Tokens crossing the boundary between two chunks of the stream are joined before being fed.
+ *
+ * @param reader The reader of the corpus, e.g. a decompressed file or stdin.
+ * @param counter The counter to feed the tokens to.
+ * @param progress The number of bytes read so far, updated periodically.
+ */
+void count_corpus_stream(
+    StreamReader &reader,
+    CorpusCounter &counter,
+    std::atomic<long long> &progress)
+{
+    std::string carry;
+    std::string_view chunk;
+    while (reader.next(chunk))
+    {
+        if (!carry.empty())
+        {
+            auto position = std::find_if(chunk.begin(), chunk.end(), is_whitespace_char) - chunk.begin();
+            carry.append(chunk.substr(0, position));
+            progress += position;
+            chunk.remove_prefix(position);
+
+            if (chunk.empty())
+            {
+                continue;
+            }
+
+            counter.feed(carry);
+            carry.clear();
+        }
+
+        // Everything after the last whitespace may be the beginning of a longer token
+        auto position = chunk.size();
+        while (position > 0 && !is_whitespace_char(chunk[position - 1]))
+        {
+            position--;
+        }
+
+        count_corpus_range(chunk.substr(0, position), counter, progress);
+        carry.assign(chunk.substr(position));
+        progress += carry.size();
+    }
+
+    if (!carry.empty())
+    {
+        counter.feed(carry);
+    }
+}
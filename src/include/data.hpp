@@ -1,16 +1,19 @@
 #pragma once
 
+#include "mapped_file.hpp"
 #include "utils.hpp"
+#include "vocabulary.hpp"
 
 /**
  * @brief Combine multiple tokens into words.
  * @param tokens The vector of tokens in the sentence.
- * @param wordlist_set The wordlist used to recognize multi-token words.
+ * @param wordlist The wordlist used to recognize multi-token words, e.g. a `std::unordered_set<std::string>`.
  * @param words The result vector to write the combined indices to.
  */
+template <typename _Wordlist>
 void combine_tokens(
     const std::vector<std::string> &tokens,
-    const std::unordered_set<std::string> &wordlist_set,
+    const _Wordlist &wordlist,
     std::vector<std::vector<std::size_t>> &words)
 {
     std::string current;
@@ -22,7 +25,7 @@ void combine_tokens(
         while (++i < tokens.size())
         {
             std::string next_word = current + ' ' + tokens[i];
-            if (wordlist_set.find(next_word) != wordlist_set.end())
+            if (wordlist.contains(next_word))
             {
                 indices.push_back(i);
                 current = next_word;
@@ -38,6 +41,14 @@ void combine_tokens(
     }
 }
 
+/**
+ * @brief Check if a character is a whitespace, the same way `std::isspace` does in the "C" locale.
+ */
+bool is_whitespace_char(const char &c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
 /**
  * @brief Check if a character is a tokenizable one (i.e. is a Vietnamese alphabet character).
  *
@@ -49,24 +60,220 @@ bool is_tokenizable_char(const char &c)
     return (c & static_cast<char>(0x80)) || std::isalpha(c);
 }
 
-void index_tokens(
-    const std::unordered_map<std::string, uint32_t> &token_map,
-    std::vector<std::string> &reversed_token_map)
+/**
+ * @brief Read a wordlist file, with multi-token words separated by underscores.
+ *
+ * @param path The path to the wordlist file.
+ * @return The lowercase words with underscores replaced by spaces, sorted and deduplicated.
+ */
+std::vector<std::string> read_wordlist(const std::string &path)
 {
-    reversed_token_map.resize(token_map.size());
-    for (const auto &[token, index] : token_map)
+    std::fstream wordlist_file(path, std::ios::in);
+    if (!wordlist_file)
+    {
+        throw std::runtime_error(utils::format("Failed to read \"%s\"", path.c_str()));
+    }
+
+    std::vector<std::string> words;
+    std::string word;
+    while (wordlist_file >> word)
     {
-        reversed_token_map[index] = token;
+        utils::to_lower(word);
+        std::replace(word.begin(), word.end(), '_', ' ');
+        words.push_back(word);
     }
+
+    std::sort(words.begin(), words.end());
+    words.erase(std::unique(words.begin(), words.end()), words.end());
+    return words;
 }
 
-uint32_t tokenize(const std::string &token, std::unordered_map<std::string, uint32_t> &token_map)
+/**
+ * @brief Read a text frequency file, with each line containing 2 tokens and the count of the bigram.
+ *
+ * The file is memory-mapped and split into line-aligned chunks parsed by separate threads. Tokens
+ * are then merged in order of the chunks, so that they are indexed in order of first occurrence as
+ * if the file was read sequentially.
+ *
+ * @param path The path to the frequency file.
+ * @param vocabulary The vocabulary to add the tokens to, in order of first occurrence.
+ * @param tuples The vector to write the bigram counts to, sorted by `(first << 32) | second`. If a
+ * bigram occurs more than once, its last count is kept.
+ * @param threads The number of threads to parse with.
+ */
+void read_frequency(
+    const std::string &path,
+    Vocabulary &vocabulary,
+    std::vector<std::pair<uint64_t, unsigned int>> &tuples,
+    std::size_t threads = std::max(1u, std::thread::hardware_concurrency()))
 {
-    auto iter = token_map.find(token);
-    if (iter == token_map.end())
+    MappedFile file(path, MADV_SEQUENTIAL);
+    const auto content = file.view();
+
+    // Chunks of at least 1MB, each ending right after a newline
+    const auto count = std::clamp<std::size_t>(content.size() >> 20, 1, threads);
+    std::vector<std::size_t> boundaries = {0};
+    for (std::size_t i = 1; i < count; i++)
+    {
+        auto position = content.find('\n', std::max(boundaries.back(), content.size() * i / count));
+        boundaries.push_back(position == std::string_view::npos ? content.size() : position + 1);
+    }
+    boundaries.push_back(content.size());
+
+    struct _Chunk
+    {
+        Vocabulary vocabulary;
+        std::vector<std::pair<uint64_t, unsigned int>> tuples;
+        std::exception_ptr error;
+    };
+
+    std::vector<_Chunk> chunks(count);
+    const auto parse = [&](std::size_t i)
+    {
+        auto &chunk = chunks[i];
+        const char *ptr = content.data() + boundaries[i], *const end = content.data() + boundaries[i + 1];
+        const auto next_field = [&ptr, end]()
+        {
+            while (ptr != end && is_whitespace_char(*ptr))
+            {
+                ptr++;
+            }
+
+            const char *begin = ptr;
+            while (ptr != end && !is_whitespace_char(*ptr))
+            {
+                ptr++;
+            }
+
+            return std::string_view(begin, ptr - begin);
+        };
+
+        try
+        {
+            for (auto first = next_field(); !first.empty(); first = next_field())
+            {
+                auto second = next_field(), value = next_field();
+
+                unsigned int freq;
+                auto [last, error] = std::from_chars(value.data(), value.data() + value.size(), freq);
+                if (value.empty() || error != std::errc() || last != value.data() + value.size())
+                {
+                    throw std::runtime_error(utils::format("Invalid line in \"%s\" at byte %zu", path.c_str(), first.data() - content.data()));
+                }
+
+                auto mask = (static_cast<uint64_t>(chunk.vocabulary.intern(first)) << 32) | chunk.vocabulary.intern(second);
+                chunk.tuples.emplace_back(mask, freq);
+            }
+        }
+        catch (...)
+        {
+            chunk.error = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (std::size_t i = 0; i < count; i++)
+    {
+        workers.emplace_back(parse, i);
+    }
+
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    // Tokens must be merged in order, the tuples can then be remapped in parallel
+    std::vector<std::vector<uint32_t>> remaps(count);
+    std::vector<std::size_t> offsets = {0};
+    for (std::size_t i = 0; i < count; i++)
+    {
+        if (chunks[i].error)
+        {
+            std::rethrow_exception(chunks[i].error);
+        }
+
+        for (std::size_t j = 0; j < chunks[i].vocabulary.size(); j++)
+        {
+            remaps[i].push_back(vocabulary.intern(chunks[i].vocabulary[j]));
+        }
+
+        offsets.push_back(offsets.back() + chunks[i].tuples.size());
+    }
+
+    tuples.resize(offsets.back());
+    workers.clear();
+    for (std::size_t i = 0; i < count; i++)
+    {
+        workers.emplace_back(
+            [&, i]()
+            {
+                const auto &remap = remaps[i];
+                for (std::size_t j = 0; j < chunks[i].tuples.size(); j++)
+                {
+                    const auto &[mask, freq] = chunks[i].tuples[j];
+                    tuples[offsets[i] + j] = std::make_pair((static_cast<uint64_t>(remap[mask >> 32]) << 32) | remap[mask & 0xFFFFFFFF], freq);
+                }
+
+                chunks[i].tuples = {};
+            });
+    }
+
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    // A stable sort keeps duplicates in file order, so that the last one wins
+    std::stable_sort(
+        std::execution::par, tuples.begin(), tuples.end(),
+        [](const auto &lhs, const auto &rhs)
+        { return lhs.first < rhs.first; });
+
+    std::size_t size = 0;
+    for (std::size_t i = 0; i < tuples.size(); i++)
+    {
+        if (i + 1 < tuples.size() && tuples[i + 1].first == tuples[i].first)
+        {
+            continue;
+        }
+
+        tuples[size++] = tuples[i];
+    }
+    tuples.resize(size);
+}
+
+/**
+ * @brief Restrict a vocabulary to the tokens referenced by some bigram.
+ *
+ * Tokens are reindexed in order of first occurrence in the sorted bigrams, which is the order
+ * `read_frequency` assigns when reading them back from a frequency file. A model built from the
+ * result is therefore identical to one built from that frequency file.
+ *
+ * @param vocabulary The full vocabulary.
+ * @param tuples The bigram counts, sorted by `(first << 32) | second`. They are remapped to the
+ * returned vocabulary and sorted again.
+ * @return The restricted vocabulary.
+ */
+Vocabulary compact_vocabulary(const Vocabulary &vocabulary, std::vector<std::pair<uint64_t, unsigned int>> &tuples)
+{
+    Vocabulary result;
+    std::vector<uint32_t> remap(vocabulary.size(), std::numeric_limits<uint32_t>::max());
+    const auto map = [&](uint64_t token)
+    {
+        if (remap[token] == std::numeric_limits<uint32_t>::max())
+        {
+            remap[token] = result.intern(vocabulary[token]);
+        }
+
+        return static_cast<uint64_t>(remap[token]);
+    };
+
+    for (auto &[mask, freq] : tuples)
     {
-        iter = token_map.emplace(token, token_map.size()).first;
+        const auto first = map(mask >> 32);
+        mask = (first << 32) | map(mask & 0xFFFFFFFF);
     }
 
-    return iter->second;
+    std::sort(std::execution::par, tuples.begin(), tuples.end());
+    return result;
 }
@@ -0,0 +1,581 @@
+#pragma once
+
+#include <zlib.h>
+
+#if __has_include(<zstd.h>)
+#include <zstd.h>
+#define SPELL_CHECKER_HAS_ZSTD
+#endif
+
+#include "utils.hpp"
+
+enum class Compression
+{
+    NONE,
+    GZIP,
+    ZIP,
+    ZSTD,
+};
+
+/**
+ * @brief Detect the compression format of a file from its first bytes.
+ */
+Compression detect_compression(std::string_view head)
+{
+    const auto starts_with = [&head](std::initializer_list<unsigned char> magic)
+    {
+        return head.size() >= magic.size() && std::equal(magic.begin(), magic.end(), reinterpret_cast<const unsigned char *>(head.data()));
+    };
+
+    if (starts_with({0x1f, 0x8b}))
+    {
+        return Compression::GZIP;
+    }
+
+    if (starts_with({0x50, 0x4b, 0x03, 0x04}))
+    {
+        return Compression::ZIP;
+    }
+
+    if (starts_with({0x28, 0xb5, 0x2f, 0xfd}))
+    {
+        return Compression::ZSTD;
+    }
+
+    return Compression::NONE;
+}
+
+/**
+ * @brief Detect the compression format of a file, see `detect_compression`.
+ */
+Compression detect_file_compression(const std::string &path)
+{
+    char head[4];
+    std::fstream input(path, std::ios::in | std::ios::binary);
+    input.read(head, sizeof(head));
+    return detect_compression(std::string_view(head, input.gcount()));
+}
+
+/**
+ * @brief A bounded ring of buffers passed from a producer thread to a consumer thread.
+ *
+ * Buffers are recycled, so memory usage is bounded by the number of buffers.
+ */
+class BufferRing
+{
+private:
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    std::deque<std::vector<char>> _filled;
+    std::vector<std::vector<char>> _free;
+    std::exception_ptr _error;
+    bool _closed = false;
+
+public:
+    BufferRing(std::size_t count, std::size_t buffer_size)
+    {
+        for (std::size_t i = 0; i < count; i++)
+        {
+            _free.emplace_back().reserve(buffer_size);
+        }
+    }
+
+    /**
+     * @brief Take an empty buffer to fill, waiting for the consumer to release one if needed.
+     *
+     * @return Whether a buffer was taken, `false` if the ring has been closed.
+     */
+    bool acquire(std::vector<char> &buffer)
+    {
+        std::unique_lock lock(_mutex);
+        _condition.wait(lock, [this]()
+                        { return _closed || !_free.empty(); });
+        if (_closed)
+        {
+            return false;
+        }
+
+        buffer = std::move(_free.back());
+        _free.pop_back();
+        buffer.clear();
+        return true;
+    }
+
+    /**
+     * @brief Pass a filled buffer to the consumer.
+     */
+    void push(std::vector<char> &&buffer)
+    {
+        {
+            std::lock_guard lock(_mutex);
+            _filled.push_back(std::move(buffer));
+        }
+
+        _condition.notify_all();
+    }
+
+    /**
+     * @brief Take the next filled buffer, waiting for the producer if needed.
+     *
+     * @return Whether a buffer was taken, `false` if the ring has been closed and drained.
+     */
+    bool pop(std::vector<char> &buffer)
+    {
+        std::unique_lock lock(_mutex);
+        _condition.wait(lock, [this]()
+                        { return _closed || !_filled.empty(); });
+        if (_error)
+        {
+            std::rethrow_exception(_error);
+        }
+
+        if (_filled.empty())
+        {
+            return false;
+        }
+
+        buffer = std::move(_filled.front());
+        _filled.pop_front();
+        return true;
+    }
+
+    /**
+     * @brief Give a consumed buffer back to the producer.
+     */
+    void release(std::vector<char> &&buffer)
+    {
+        {
+            std::lock_guard lock(_mutex);
+            _free.push_back(std::move(buffer));
+        }
+
+        _condition.notify_all();
+    }
+
+    /**
+     * @brief Stop the transfer, from either side.
+     *
+     * @param error An optional exception to rethrow in the consumer.
+     */
+    void close(std::exception_ptr error = nullptr)
+    {
+        {
+            std::lock_guard lock(_mutex);
+            _closed = true;
+            if (error)
+            {
+                _error = error;
+            }
+        }
+
+        _condition.notify_all();
+    }
+};
+
+/**
+ * @brief Reader of a possibly compressed file, decompressing on a separate pipeline thread.
+ *
+ * Supported formats are gzip, zip (the first non-empty file of the archive) and zstd (if compiled
+ * with libzstd). Uncompressed input is passed through unchanged.
+ */
+class StreamReader
+{
+private:
+    FILE *_input;
+    BufferRing _ring;
+    std::thread _producer;
+    std::vector<char> _current;
+    bool _has_current = false;
+
+    std::vector<char> _head;
+    std::size_t _head_offset = 0;
+
+    std::vector<char> _output;
+    bool _stopped = false;
+
+    /**
+     * @brief Read raw bytes, starting with the ones consumed by format detection.
+     */
+    std::size_t _read(char *dest, std::size_t size)
+    {
+        if (_head_offset < _head.size())
+        {
+            size = std::min(size, _head.size() - _head_offset);
+            std::memcpy(dest, _head.data() + _head_offset, size);
+            _head_offset += size;
+            return size;
+        }
+
+        auto result = std::fread(dest, 1, size, _input);
+        if (result == 0 && std::ferror(_input))
+        {
+            throw std::runtime_error("Failed to read corpus input");
+        }
+
+        return result;
+    }
+
+    /**
+     * @brief Read exactly `size` raw bytes.
+     */
+    void _read_exact(char *dest, std::size_t size)
+    {
+        while (size > 0)
+        {
+            auto count = _read(dest, size);
+            if (count == 0)
+            {
+                throw std::runtime_error("Unexpected end of compressed input");
+            }
+
+            dest += count;
+            size -= count;
+        }
+    }
+
+    /**
+     * @brief Append decompressed bytes, passing full buffers to the consumer.
+     */
+    void _emit(const char *data, std::size_t size)
+    {
+        while (size > 0 && !_stopped)
+        {
+            auto count = std::min(size, _output.capacity() - _output.size());
+            _output.insert(_output.end(), data, data + count);
+            data += count;
+            size -= count;
+
+            if (_output.size() == _output.capacity())
+            {
+                _flush();
+            }
+        }
+    }
+
+    void _flush()
+    {
+        if (!_output.empty())
+        {
+            _ring.push(std::move(_output));
+            _stopped = !_ring.acquire(_output);
+        }
+    }
+
+    void _inflate(int window_bits, bool multiple_members)
+    {
+        z_stream stream;
+        std::memset(&stream, 0, sizeof(stream));
+        if (inflateInit2(&stream, window_bits) != Z_OK)
+        {
+            throw std::runtime_error("Failed to initialize zlib");
+        }
+
+        std::vector<char> input(1 << 20), output(1 << 20);
+        int status = Z_OK;
+        while (!_stopped)
+        {
+            // A full output buffer may leave decompressed bytes pending without consuming more input
+            if (stream.avail_in == 0 && stream.avail_out != 0)
+            {
+                stream.avail_in = _read(input.data(), input.size());
+                stream.next_in = reinterpret_cast<Bytef *>(input.data());
+                if (stream.avail_in == 0)
+                {
+                    // The input may only end right after a complete stream
+                    if (status != Z_STREAM_END)
+                    {
+                        inflateEnd(&stream);
+                        throw std::runtime_error("Unexpected end of compressed input");
+                    }
+
+                    break;
+                }
+            }
+
+            stream.avail_out = output.size();
+            stream.next_out = reinterpret_cast<Bytef *>(output.data());
+            status = inflate(&stream, Z_NO_FLUSH);
+            if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+            {
+                inflateEnd(&stream);
+                throw std::runtime_error(utils::format("Corrupted compressed input (zlib error %d)", status));
+            }
+
+            _emit(output.data(), output.size() - stream.avail_out);
+            if (status == Z_STREAM_END)
+            {
+                if (!multiple_members)
+                {
+                    break;
+                }
+
+                // Concatenated gzip members
+                inflateReset(&stream);
+            }
+        }
+
+        inflateEnd(&stream);
+    }
+
+    /**
+     * @brief Read and discard exactly `size` raw bytes.
+     */
+    void _skip(uint64_t size)
+    {
+        std::vector<char> buffer(std::min<uint64_t>(size, 1 << 20));
+        while (size > 0)
+        {
+            const auto count = std::min<uint64_t>(size, buffer.size());
+            _read_exact(buffer.data(), count);
+            size -= count;
+        }
+    }
+
+    /**
+     * @brief Extract the first file of a zip archive, skipping directories and empty files.
+     */
+    void _unzip()
+    {
+        const auto read_u16 = [](const char *ptr)
+        {
+            uint16_t value;
+            std::memcpy(&value, ptr, sizeof(value));
+            return value;
+        };
+        const auto read_u32 = [](const char *ptr)
+        {
+            uint32_t value;
+            std::memcpy(&value, ptr, sizeof(value));
+            return value;
+        };
+
+        while (true)
+        {
+            char header[30];
+            _read_exact(header, sizeof(header));
+
+            // Local file headers are followed by the central directory once all entries are read
+            if (read_u32(header) != 0x04034b50)
+            {
+                throw std::runtime_error("No file found in zip archive");
+            }
+
+            const auto flags = read_u16(header + 6), method = read_u16(header + 8);
+            uint64_t compressed_size = read_u32(header + 18), size = read_u32(header + 22);
+
+            const auto name_length = read_u16(header + 26);
+            std::vector<char> extra(name_length + read_u16(header + 28));
+            _read_exact(extra.data(), extra.size());
+            const std::string_view name(extra.data(), name_length);
+
+            // The actual sizes of a ZIP64 entry are stored in the extra field, only for the sizes
+            // saturated in the header and in that order
+            for (std::size_t i = name_length; i + 4 <= extra.size();)
+            {
+                const auto id = read_u16(extra.data() + i), length = read_u16(extra.data() + i + 2);
+                if (id == 0x0001)
+                {
+                    std::size_t offset = i + 4;
+                    for (auto field : {&size, &compressed_size})
+                    {
+                        if (*field == 0xFFFFFFFF && offset + 8 <= i + 4 + length && offset + 8 <= extra.size())
+                        {
+                            std::memcpy(field, extra.data() + offset, sizeof(*field));
+                            offset += 8;
+                        }
+                    }
+                }
+
+                i += 4 + length;
+            }
+
+            // With a data descriptor, the sizes are only known after the data
+            const bool descriptor = flags & 0x08;
+            if (!name.ends_with('/') && (descriptor || size > 0))
+            {
+                if (method == 8)
+                {
+                    _inflate(-MAX_WBITS, false);
+                }
+                else if (method == 0)
+                {
+                    if (descriptor)
+                    {
+                        throw std::runtime_error(utils::format("Unsupported stored zip entry \"%s\" with a data descriptor", std::string(name).c_str()));
+                    }
+
+                    std::vector<char> buffer(1 << 20);
+                    while (size > 0 && !_stopped)
+                    {
+                        auto count = _read(buffer.data(), std::min<uint64_t>(size, buffer.size()));
+                        if (count == 0)
+                        {
+                            throw std::runtime_error("Unexpected end of zip archive");
+                        }
+
+                        _emit(buffer.data(), count);
+                        size -= count;
+                    }
+                }
+                else
+                {
+                    throw std::runtime_error(utils::format("Unsupported zip compression method %u", method));
+                }
+
+                return;
+            }
+
+            if (descriptor)
+            {
+                throw std::runtime_error(utils::format("Cannot skip zip entry \"%s\" with a data descriptor", std::string(name).c_str()));
+            }
+
+            _skip(compressed_size);
+        }
+    }
+
+    void _unzstd()
+    {
+#ifdef SPELL_CHECKER_HAS_ZSTD
+        auto stream = ZSTD_createDStream();
+        std::vector<char> input(ZSTD_DStreamInSize()), output(ZSTD_DStreamOutSize());
+        ZSTD_inBuffer in = {input.data(), 0, 0};
+        std::size_t status = 0;
+        ZSTD_outBuffer out = {output.data(), output.size(), 0};
+        while (!_stopped)
+        {
+            // A full output buffer may leave decompressed bytes pending without consuming more input
+            if (in.pos == in.size && out.pos != out.size)
+            {
+                in.size = _read(input.data(), input.size());
+                in.pos = 0;
+                if (in.size == 0)
+                {
+                    // The input may only end right after a complete frame
+                    if (status != 0)
+                    {
+                        ZSTD_freeDStream(stream);
+                        throw std::runtime_error("Unexpected end of compressed input");
+                    }
+
+                    break;
+                }
+            }
+
+            out = {output.data(), output.size(), 0};
+            status = ZSTD_decompressStream(stream, &out, &in);
+            if (ZSTD_isError(status))
+            {
+                ZSTD_freeDStream(stream);
+                throw std::runtime_error(utils::format("Corrupted compressed input (%s)", ZSTD_getErrorName(status)));
+            }
+
+            _emit(output.data(), out.pos);
+        }
+
+        ZSTD_freeDStream(stream);
+#else
+        throw std::runtime_error("zstd input is not supported, rebuild with libzstd");
+#endif
+    }
+
+    void _produce()
+    {
+        try
+        {
+            _head.resize(4);
+            _head.resize(std::fread(_head.data(), 1, _head.size(), _input));
+
+            if (_ring.acquire(_output))
+            {
+                switch (detect_compression(std::string_view(_head.data(), _head.size())))
+                {
+                case Compression::GZIP:
+                    _inflate(MAX_WBITS + 16, true);
+                    break;
+
+                case Compression::ZIP:
+                    _unzip();
+                    break;
+
+                case Compression::ZSTD:
+                    _unzstd();
+                    break;
+
+                case Compression::NONE:
+                {
+                    std::vector<char> buffer(1 << 20);
+                    while (!_stopped)
+                    {
+                        auto count = _read(buffer.data(), buffer.size());
+                        if (count == 0)
+                        {
+                            break;
+                        }
+
+                        _emit(buffer.data(), count);
+                    }
+                    break;
+                }
+                }
+
+                _flush();
+            }
+
+            _ring.close();
+        }
+        catch (...)
+        {
+            _ring.close(std::current_exception());
+        }
+    }
+
+public:
+    /**
+     * @param path The path to the input file, or "-" for stdin.
+     * @param buffer_count The number of buffers in the ring.
+     * @param buffer_size The size of each buffer in bytes.
+     */
+    StreamReader(const std::string &path, std::size_t buffer_count = 8, std::size_t buffer_size = 1 << 22)
+        : _input(path == "-" ? stdin : std::fopen(path.c_str(), "rb")),
+          _ring(buffer_count, buffer_size)
+    {
+        if (_input == nullptr)
+        {
+            throw std::runtime_error(utils::format("Failed to read \"%s\"", path.c_str()));
+        }
+
+        _producer = std::thread(&StreamReader::_produce, this);
+    }
+
+    StreamReader(const StreamReader &) = delete;
+    StreamReader &operator=(const StreamReader &) = delete;
+
+    ~StreamReader()
+    {
+        _ring.close();
+        _producer.join();
+
+        if (_input != stdin)
+        {
+            std::fclose(_input);
+        }
+    }
+
+    /**
+     * @brief Get the next chunk of decompressed data, invalidating the previous one.
+     *
+     * @return Whether a chunk was read, `false` at the end of the input.
+     */
+    bool next(std::string_view &chunk)
+    {
+        if (_has_current)
+        {
+            _ring.release(std::move(_current));
+        }
+
+        _has_current = _ring.pop(_current);
+        chunk = std::string_view(_current.data(), _has_current ? _current.size() : 0);
+        return _has_current;
+    }
+};
@@ -0,0 +1,197 @@
+#pragma once
+
+#include "utils.hpp"
+
+/**
+ * @brief Hash a string of characters, see `utils::utf8_characters`.
+ */
+uint64_t hash_characters(std::span<const uint32_t> characters)
+{
+    uint64_t result = characters.size();
+    for (auto c : characters)
+    {
+        result = utils::hash64(result ^ c) + c;
+    }
+
+    return result;
+}
+
+/**
+ * @brief Call `callback` with the hash of every string obtained by deleting at most `distance`
+ * characters from `characters`, including `characters` itself. Hashes may repeat.
+ */
+template <typename _Callback>
+void for_each_delete(std::span<const uint32_t> characters, std::size_t distance, _Callback &&callback)
+{
+    // Deleted positions are chosen in increasing order, so that each combination is visited once
+    const auto visit = [&callback](auto &&self, const std::vector<uint32_t> &current, std::size_t start, std::size_t remaining) -> void
+    {
+        callback(hash_characters(current));
+        if (remaining == 0 || current.empty())
+        {
+            return;
+        }
+
+        std::vector<uint32_t> next(current.size() - 1);
+        for (std::size_t i = start; i < current.size(); i++)
+        {
+            std::copy(current.begin(), current.begin() + i, next.begin());
+            std::copy(current.begin() + i + 1, current.end(), next.begin() + i);
+            self(self, next, i, remaining - 1);
+        }
+    };
+
+    visit(visit, std::vector<uint32_t>(characters.begin(), characters.end()), 0, distance);
+}
+
+/**
+ * @brief The distinct delete hashes of a string, see `for_each_delete`.
+ */
+void distinct_deletes(std::span<const uint32_t> characters, std::size_t distance, std::vector<uint64_t> &hashes)
+{
+    hashes.clear();
+    for_each_delete(
+        characters, distance,
+        [&hashes](uint64_t hash)
+        { hashes.push_back(hash); });
+
+    std::sort(hashes.begin(), hashes.end());
+    hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+}
+
+/**
+ * @brief A read-only symmetric delete index (as in SymSpell) over the tokens of a model.
+ *
+ * Two strings within edit distance `k` share a string obtained by deleting at most `k` characters
+ * from each of them. Every such delete of every token is hashed into a bucket of a flat table, each
+ * entry holding the upper 32 bits of the hash as a fingerprint and the token index.
+ *
+ * @see https://github.com/wolfgarbe/SymSpell
+ */
+class DeleteIndex
+{
+private:
+    uint32_t _distance = 0;
+    std::span<const uint32_t> _offsets;
+    std::span<const uint64_t> _entries;
+
+public:
+    DeleteIndex() = default;
+    DeleteIndex(uint32_t distance, std::span<const uint32_t> offsets, std::span<const uint64_t> entries)
+        : _distance(distance), _offsets(offsets), _entries(entries) {}
+
+    /**
+     * @brief The maximum edit distance within which lookups are complete.
+     */
+    std::size_t distance() const
+    {
+        return _distance;
+    }
+
+    bool empty() const
+    {
+        return _entries.empty();
+    }
+
+    /**
+     * @brief Find the tokens that may be within edit distance `distance` of a string.
+     *
+     * The result may contain false positives, which have to be filtered by computing the actual
+     * distances. There is no false negative if `distance` does not exceed `distance()`.
+     *
+     * @param characters The characters of the string.
+     * @param distance The edit distance, capped at `distance()`.
+     * @param tokens The vector to write the sorted indices of the tokens to.
+     */
+    void lookup(std::span<const uint32_t> characters, std::size_t distance, std::vector<uint32_t> &tokens) const
+    {
+        tokens.clear();
+        if (empty())
+        {
+            return;
+        }
+
+        thread_local std::vector<uint64_t> hashes;
+        distinct_deletes(characters, std::min<std::size_t>(distance, _distance), hashes);
+
+        const auto mask = _offsets.size() - 2;
+        for (auto hash : hashes)
+        {
+            const auto bucket = hash & mask;
+            const auto fingerprint = hash >> 32;
+            for (auto i = _offsets[bucket]; i < _offsets[bucket + 1]; i++)
+            {
+                if (_entries[i] >> 32 == fingerprint)
+                {
+                    tokens.push_back(_entries[i] & 0xFFFFFFFF);
+                }
+            }
+        }
+
+        std::sort(tokens.begin(), tokens.end());
+        tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+    }
+};
+
+/**
+ * @brief Build the flat table of a `DeleteIndex`.
+ *
+ * @param characters The characters of each token, indexed by token.
+ * @param distance The maximum number of deleted characters.
+ * @param offsets The vector to write the range of entries of each bucket to, the bucket count is
+ * a power of 2.
+ * @param entries The vector to write the entries to, grouped by bucket.
+ */
+template <typename _Characters>
+void build_delete_index(
+    const _Characters &characters,
+    std::size_t distance,
+    std::vector<uint32_t> &offsets,
+    std::vector<uint64_t> &entries)
+{
+    const std::size_t token_count = characters.size();
+
+    // The distinct deletes of each token, generated in parallel
+    std::vector<std::vector<uint64_t>> deletes(token_count);
+    std::vector<uint32_t> indices(token_count);
+    std::iota(indices.begin(), indices.end(), 0);
+    std::for_each(
+        std::execution::par, indices.begin(), indices.end(),
+        [&](uint32_t token)
+        { distinct_deletes(characters[token], distance, deletes[token]); });
+
+    std::size_t entry_count = 0;
+    for (const auto &hashes : deletes)
+    {
+        entry_count += hashes.size();
+    }
+
+    if (entry_count > std::numeric_limits<uint32_t>::max())
+    {
+        throw std::overflow_error("Delete index exceeds 2^32 entries");
+    }
+
+    // About 2 entries per bucket, placed with a counting sort so that tokens stay in ascending order
+    const auto bucket_count = std::bit_ceil(std::max<std::size_t>(1, entry_count / 2));
+    const auto mask = bucket_count - 1;
+
+    offsets.assign(bucket_count + 1, 0);
+    for (const auto &hashes : deletes)
+    {
+        for (auto hash : hashes)
+        {
+            offsets[(hash & mask) + 1]++;
+        }
+    }
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+    std::vector<uint32_t> positions(offsets.begin(), offsets.end() - 1);
+    entries.resize(entry_count);
+    for (uint32_t token = 0; token < token_count; token++)
+    {
+        for (auto hash : deletes[token])
+        {
+            entries[positions[hash & mask]++] = ((hash >> 32) << 32) | token;
+        }
+    }
+}
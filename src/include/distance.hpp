@@ -1,93 +1,285 @@
 #pragma once
 
-#include "standard.hpp"
-
-template <bool _AllowTransposition>
-std::size_t _levenshtein_dp(
-    const std::string &first,
-    const std::string &second,
-    const std::size_t &i,
-    const std::size_t &j,
-    const std::vector<std::size_t> &offset_i,
-    const std::vector<std::size_t> &offset_j,
-    std::vector<std::vector<std::size_t>> &dp)
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "utils.hpp"
+
+/**
+ * @brief Damerau-Levenshtein distance (optimal string alignment) between two strings of characters,
+ * bounded by `k`.
+ *
+ * Only the diagonal band of width `2k + 1` of the DP table is evaluated, with 3 rolling rows.
+ *
+ * @return The distance if it does not exceed `k`, otherwise `k + 1`.
+ */
+template <typename T>
+std::size_t damerau_levenshtein(std::span<const T> first, std::span<const T> second, std::size_t k)
 {
-    std::size_t &result = dp[i][j];
-    if (result != std::numeric_limits<std::size_t>::max())
+    const std::size_t n = first.size(), m = second.size(), limit = k + 1;
+    if ((n > m ? n - m : m - n) > k)
+    {
+        return limit;
+    }
+
+    if (n == 0 || m == 0)
     {
-        return result;
+        return std::max(n, m);
     }
 
-    // std::cerr << std::make_pair(i, j) << " Comparing \"" << first.substr(0, offset_i[i]) << "\" and \"" << second.substr(0, offset_j[j]) << "\"" << std::endl;
-    if (i == j && i == 0)
+    thread_local std::vector<std::size_t> rows[3];
+    for (auto &row : rows)
     {
-        return result = 0;
+        row.resize(m + 1);
     }
 
-    if (i > 0)
+    auto *before = rows[0].data(), *previous = rows[1].data(), *current = rows[2].data();
+    for (std::size_t j = 0; j <= m; j++)
     {
-        result = std::min(result, _levenshtein_dp<_AllowTransposition>(first, second, i - 1, j, offset_i, offset_j, dp) + 1);
+        current[j] = std::min(j, limit);
     }
 
-    if (j > 0)
+    for (std::size_t i = 1; i <= n; i++)
     {
-        result = std::min(result, _levenshtein_dp<_AllowTransposition>(first, second, i, j - 1, offset_i, offset_j, dp) + 1);
+        std::swap(before, previous);
+        std::swap(previous, current);
+
+        const auto low = i > k ? i - k : 1, high = std::min(m, i + k);
+        current[low - 1] = low == 1 ? std::min(i, limit) : limit;
+
+        auto row_min = current[low - 1];
+        for (std::size_t j = low; j <= high; j++)
+        {
+            auto result = std::min(previous[j] + 1, current[j - 1] + 1);
+            result = std::min(result, previous[j - 1] + (first[i - 1] != second[j - 1]));
+
+            if (i > 1 && j > 1 && first[i - 2] == second[j - 1] && first[i - 1] == second[j - 2])
+            {
+                result = std::min(result, before[j - 2] + 1);
+            }
+
+            current[j] = std::min(result, limit);
+            row_min = std::min(row_min, current[j]);
+        }
+
+        // The next row reads one cell past the band
+        if (high < m)
+        {
+            current[high + 1] = limit;
+        }
+
+        // No alignment can get back under the bound
+        if (row_min > k)
+        {
+            return limit;
+        }
     }
 
-    if (i > 0 && j > 0)
+    return current[m];
+}
+
+/**
+ * @brief Damerau-Levenshtein distance (optimal string alignment) between two UTF-8 strings, bounded by `k`.
+ *
+ * @return The distance if it does not exceed `k`, otherwise `k + 1`.
+ */
+std::size_t damerau_levenshtein(std::string_view first, std::string_view second, std::size_t k)
+{
+    thread_local std::vector<uint32_t> first_characters, second_characters;
+    first_characters.clear();
+    second_characters.clear();
+    utils::utf8_characters(first, first_characters);
+    utils::utf8_characters(second, second_characters);
+
+    return damerau_levenshtein(std::span<const uint32_t>(first_characters), std::span<const uint32_t>(second_characters), k);
+}
+
+/**
+ * @brief Damerau-Levenshtein distance (optimal string alignment) between two UTF-8 strings.
+ */
+std::size_t damerau_levenshtein(std::string_view first, std::string_view second)
+{
+    return damerau_levenshtein(first, second, std::max(first.size(), second.size()));
+}
+
+/**
+ * @brief Bit masks of the positions of each distinct character in a query of at most 64 characters.
+ */
+class _QueryMasks
+{
+private:
+    std::vector<uint32_t> _characters;
+    std::vector<uint64_t> _masks;
+
+public:
+    void assign(std::span<const uint32_t> query)
     {
-        bool ij_equal = std::equal(
-            first.begin() + offset_i[i - 1], first.begin() + offset_i[i],
-            second.begin() + offset_j[j - 1], second.begin() + offset_j[j]);
+        _characters.clear();
+        _masks.clear();
+        for (std::size_t i = 0; i < query.size(); i++)
+        {
+            auto iter = std::find(_characters.begin(), _characters.end(), query[i]);
+            if (iter == _characters.end())
+            {
+                _characters.push_back(query[i]);
+                _masks.push_back(0);
+                iter = _characters.end() - 1;
+            }
 
-        result = std::min(result, _levenshtein_dp<_AllowTransposition>(first, second, i - 1, j - 1, offset_i, offset_j, dp) + !ij_equal);
+            _masks[iter - _characters.begin()] |= 1ULL << i;
+        }
+    }
 
-        if constexpr (_AllowTransposition)
+    uint64_t operator[](uint32_t character) const
+    {
+        for (std::size_t i = 0; i < _characters.size(); i++)
         {
-            if (i > 1 && j > 1)
+            if (_characters[i] == character)
             {
-                bool ix_j_equal = std::equal(
-                    first.begin() + offset_i[i - 2], first.begin() + offset_i[i - 1],
-                    second.begin() + offset_j[j - 1], second.begin() + offset_j[j]);
-                bool i_jx_equal = std::equal(
-                    first.begin() + offset_i[i - 1], first.begin() + offset_i[i],
-                    second.begin() + offset_j[j - 2], second.begin() + offset_j[j - 1]);
-
-                if (ix_j_equal && i_jx_equal)
-                {
-                    result = std::min(result, _levenshtein_dp<_AllowTransposition>(first, second, i - 2, j - 2, offset_i, offset_j, dp) + 1);
-                }
+                return _masks[i];
             }
         }
+
+        return 0;
+    }
+};
+
+/**
+ * @brief Bit-parallel Damerau-Levenshtein distance (optimal string alignment) of Hyyrö, for a query
+ * of `1` to `64` characters.
+ *
+ * @see https://doi.org/10.1007/3-540-44888-8_15
+ */
+std::size_t _bit_parallel_damerau_levenshtein(const _QueryMasks &masks, std::size_t query_size, std::span<const uint32_t> text)
+{
+    const uint64_t last = 1ULL << (query_size - 1);
+    uint64_t vp = ~0ULL, vn = 0, d0 = 0, pm = 0;
+    std::size_t score = query_size;
+    for (auto character : text)
+    {
+        const auto previous_pm = pm;
+        pm = masks[character];
+
+        const auto tr = (((~d0) & pm) << 1) & previous_pm;
+        d0 = (((pm & vp) + vp) ^ vp) | pm | vn | tr;
+
+        auto hp = vn | ~(d0 | vp), hn = d0 & vp;
+        score += (hp & last) != 0;
+        score -= (hn & last) != 0;
+
+        hp = (hp << 1) | 1;
+        hn = hn << 1;
+        vp = hn | ~(d0 | hp);
+        vn = hp & d0;
     }
 
-    return result;
+    return score;
 }
 
-std::size_t damerau_levenshtein(const std::string &first, const std::string &second)
+#if defined(__x86_64__)
+/**
+ * @brief `_bit_parallel_damerau_levenshtein` of 4 texts at once, one per 64-bit lane.
+ */
+__attribute__((target("avx2"))) void _bit_parallel_damerau_levenshtein_x4(
+    const _QueryMasks &masks,
+    std::size_t query_size,
+    const std::span<const uint32_t> *texts,
+    std::size_t *distances)
 {
-    std::size_t n = first.size(), m = second.size();
-    std::vector<std::vector<std::size_t>> dp(n + 1, std::vector<std::size_t>(m + 1, std::numeric_limits<std::size_t>::max()));
+    const auto last = _mm256_set1_epi64x(1LL << (query_size - 1)), ones = _mm256_set1_epi64x(-1), one = _mm256_set1_epi64x(1);
+    const auto sizes = _mm256_set_epi64x(texts[3].size(), texts[2].size(), texts[1].size(), texts[0].size());
+
+    auto vp = ones, vn = _mm256_setzero_si256(), d0 = _mm256_setzero_si256(), pm = _mm256_setzero_si256();
+    auto score = _mm256_set1_epi64x(query_size);
+
+    const auto steps = std::max({texts[0].size(), texts[1].size(), texts[2].size(), texts[3].size()});
+    for (std::size_t s = 0; s < steps; s++)
+    {
+        const auto lane = [&](int i) -> long long
+        {
+            return s < texts[i].size() ? masks[texts[i][s]] : 0;
+        };
 
-    std::vector<std::size_t> offset_i;
-    for (std::size_t i = 0; i < n; i++)
+        // Lanes whose text has ended keep their state
+        const auto active = _mm256_cmpgt_epi64(sizes, _mm256_set1_epi64x(s));
+
+        const auto previous_pm = pm;
+        pm = _mm256_set_epi64x(lane(3), lane(2), lane(1), lane(0));
+
+        const auto tr = _mm256_and_si256(_mm256_slli_epi64(_mm256_andnot_si256(d0, pm), 1), previous_pm);
+        const auto new_d0 = _mm256_or_si256(
+            _mm256_or_si256(_mm256_xor_si256(_mm256_add_epi64(_mm256_and_si256(pm, vp), vp), vp), pm),
+            _mm256_or_si256(vn, tr));
+
+        auto hp = _mm256_or_si256(vn, _mm256_xor_si256(_mm256_or_si256(new_d0, vp), ones));
+        auto hn = _mm256_and_si256(new_d0, vp);
+
+        // Comparisons yield -1 in lanes where the last bit is set
+        score = _mm256_sub_epi64(score, _mm256_and_si256(active, _mm256_cmpeq_epi64(_mm256_and_si256(hp, last), last)));
+        score = _mm256_add_epi64(score, _mm256_and_si256(active, _mm256_cmpeq_epi64(_mm256_and_si256(hn, last), last)));
+
+        hp = _mm256_or_si256(_mm256_slli_epi64(hp, 1), one);
+        hn = _mm256_slli_epi64(hn, 1);
+
+        const auto new_vp = _mm256_or_si256(hn, _mm256_xor_si256(_mm256_or_si256(new_d0, hp), ones));
+        const auto new_vn = _mm256_and_si256(hp, new_d0);
+
+        vp = _mm256_blendv_epi8(vp, new_vp, active);
+        vn = _mm256_blendv_epi8(vn, new_vn, active);
+        d0 = _mm256_blendv_epi8(d0, new_d0, active);
+        pm = _mm256_blendv_epi8(previous_pm, pm, active);
+    }
+
+    alignas(32) long long result[4];
+    _mm256_store_si256(reinterpret_cast<__m256i *>(result), score);
+    std::copy(result, result + 4, distances);
+}
+#endif
+
+/**
+ * @brief Damerau-Levenshtein distances (optimal string alignment) from one query to many texts.
+ *
+ * Queries of up to 64 characters use the bit-parallel algorithm, on 4 texts at once if the CPU
+ * supports AVX2. Longer queries fall back to the DP.
+ *
+ * @param query The characters of the query.
+ * @param texts The characters of each text.
+ * @param distances The vector to write the distance to each text to.
+ */
+void damerau_levenshtein(
+    std::span<const uint32_t> query,
+    const std::vector<std::span<const uint32_t>> &texts,
+    std::vector<std::size_t> &distances)
+{
+    distances.resize(texts.size());
+    if (query.empty() || query.size() > 64)
     {
-        if ((first[i] & 0xC0) != 0x80)
+        for (std::size_t i = 0; i < texts.size(); i++)
         {
-            offset_i.push_back(i);
+            distances[i] = damerau_levenshtein(query, texts[i], std::max(query.size(), texts[i].size()));
         }
+
+        return;
     }
-    offset_i.push_back(n);
 
-    std::vector<std::size_t> offset_j;
-    for (std::size_t j = 0; j < m; j++)
+    thread_local _QueryMasks masks;
+    masks.assign(query);
+
+    std::size_t i = 0;
+#if defined(__x86_64__)
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2)
     {
-        if ((second[j] & 0xC0) != 0x80)
+        for (; i + 4 <= texts.size(); i += 4)
         {
-            offset_j.push_back(j);
+            _bit_parallel_damerau_levenshtein_x4(masks, query.size(), texts.data() + i, distances.data() + i);
         }
     }
-    offset_j.push_back(m);
+#endif
 
-    return _levenshtein_dp<true>(first, second, offset_i.size() - 1, offset_j.size() - 1, offset_i, offset_j, dp);
+    for (; i < texts.size(); i++)
+    {
+        distances[i] = _bit_parallel_damerau_levenshtein(masks, query.size(), texts[i]);
+    }
 }
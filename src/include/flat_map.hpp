@@ -0,0 +1,256 @@
+#pragma once
+
+#include "utils.hpp"
+
+/**
+ * @brief An open-addressing hash map from unsigned integers, with linear probing.
+ *
+ * Entries are stored inline in a single power-of-2 array, so that there is no allocation per
+ * entry and probing scans contiguous memory. The table grows by doubling once it is 3/4 full.
+ *
+ * The maximum value of `K` marks empty slots and cannot be used as a key. This is never the case
+ * for token indices or bigram masks built from them.
+ */
+template <typename K, typename V>
+class FlatMap
+{
+    static_assert(std::is_unsigned_v<K>);
+
+public:
+    using key_type = K;
+    using mapped_type = V;
+    using value_type = std::pair<K, V>;
+
+    static constexpr K EMPTY = std::numeric_limits<K>::max();
+
+private:
+    std::vector<value_type> _slots;
+    std::size_t _size = 0;
+
+    template <bool _Const>
+    class _Iterator
+    {
+    private:
+        using _slot_ptr = std::conditional_t<_Const, const std::pair<K, V> *, std::pair<K, V> *>;
+
+        _slot_ptr _ptr, _end;
+
+        void _skip()
+        {
+            while (_ptr != _end && _ptr->first == EMPTY)
+            {
+                _ptr++;
+            }
+        }
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::pair<K, V>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = _slot_ptr;
+        using reference = std::remove_pointer_t<_slot_ptr> &;
+
+        _Iterator() : _ptr(nullptr), _end(nullptr) {}
+        _Iterator(_slot_ptr ptr, _slot_ptr end) : _ptr(ptr), _end(end)
+        {
+            _skip();
+        }
+
+        reference operator*() const
+        {
+            return *_ptr;
+        }
+
+        pointer operator->() const
+        {
+            return _ptr;
+        }
+
+        _Iterator &operator++()
+        {
+            _ptr++;
+            _skip();
+            return *this;
+        }
+
+        _Iterator operator++(int)
+        {
+            auto result = *this;
+            ++*this;
+            return result;
+        }
+
+        bool operator==(const _Iterator &other) const
+        {
+            return _ptr == other._ptr;
+        }
+    };
+
+    std::size_t _mask() const
+    {
+        return _slots.size() - 1;
+    }
+
+    /**
+     * @brief Find the slot holding `key`, or the empty slot where it would be inserted.
+     */
+    std::size_t _probe(K key) const
+    {
+        auto index = utils::hash64(key) & _mask();
+        while (_slots[index].first != key && _slots[index].first != EMPTY)
+        {
+            index = (index + 1) & _mask();
+        }
+
+        return index;
+    }
+
+    void _rehash(std::size_t capacity)
+    {
+        std::vector<value_type> slots(capacity, value_type(EMPTY, V()));
+        _slots.swap(slots);
+        for (auto &slot : slots)
+        {
+            if (slot.first != EMPTY)
+            {
+                _slots[_probe(slot.first)] = std::move(slot);
+            }
+        }
+    }
+
+    static std::size_t _capacity_for(std::size_t size)
+    {
+        return std::bit_ceil(std::max<std::size_t>(16, size + size / 3 + 1));
+    }
+
+public:
+    using iterator = _Iterator<false>;
+    using const_iterator = _Iterator<true>;
+
+    FlatMap() = default;
+
+    std::size_t size() const
+    {
+        return _size;
+    }
+
+    bool empty() const
+    {
+        return _size == 0;
+    }
+
+    /**
+     * @brief Allocate enough slots to hold `size` entries without growing.
+     */
+    void reserve(std::size_t size)
+    {
+        auto capacity = _capacity_for(size);
+        if (capacity > _slots.size())
+        {
+            _rehash(capacity);
+        }
+    }
+
+    /**
+     * @brief Remove all entries, keeping the allocated slots.
+     */
+    void clear()
+    {
+        std::fill(_slots.begin(), _slots.end(), value_type(EMPTY, V()));
+        _size = 0;
+    }
+
+    iterator begin()
+    {
+        return iterator(_slots.data(), _slots.data() + _slots.size());
+    }
+
+    iterator end()
+    {
+        return iterator(_slots.data() + _slots.size(), _slots.data() + _slots.size());
+    }
+
+    const_iterator begin() const
+    {
+        return const_iterator(_slots.data(), _slots.data() + _slots.size());
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(_slots.data() + _slots.size(), _slots.data() + _slots.size());
+    }
+
+    iterator find(K key)
+    {
+        if (_slots.empty())
+        {
+            return end();
+        }
+
+        auto index = _probe(key);
+        return _slots[index].first == EMPTY ? end() : iterator(_slots.data() + index, _slots.data() + _slots.size());
+    }
+
+    const_iterator find(K key) const
+    {
+        if (_slots.empty())
+        {
+            return end();
+        }
+
+        auto index = _probe(key);
+        return _slots[index].first == EMPTY ? end() : const_iterator(_slots.data() + index, _slots.data() + _slots.size());
+    }
+
+    /**
+     * @brief Insert an entry if `key` is not present yet.
+     *
+     * @return The iterator to the entry of `key`, and whether it was inserted.
+     */
+    std::pair<iterator, bool> emplace(K key, V value)
+    {
+        if ((_size + 1) * 4 > _slots.size() * 3)
+        {
+            _rehash(std::max<std::size_t>(16, 2 * _slots.size()));
+        }
+
+        auto index = _probe(key);
+        auto &slot = _slots[index];
+        auto inserted = slot.first == EMPTY;
+        if (inserted)
+        {
+            slot = value_type(key, std::move(value));
+            _size++;
+        }
+
+        return std::make_pair(iterator(&slot, _slots.data() + _slots.size()), inserted);
+    }
+
+    V &operator[](K key)
+    {
+        return emplace(key, V()).first->second;
+    }
+
+    /**
+     * @brief Remove all entries satisfying a predicate.
+     *
+     * @return The number of removed entries.
+     */
+    template <typename _Predicate>
+    friend std::size_t erase_if(FlatMap &map, _Predicate predicate)
+    {
+        const auto size = map._size;
+        for (auto &slot : map._slots)
+        {
+            if (slot.first != EMPTY && predicate(std::as_const(slot)))
+            {
+                slot.first = EMPTY;
+                map._size--;
+            }
+        }
+
+        // Reinsert the remaining entries so that no probe sequence is broken
+        map._rehash(_capacity_for(map._size));
+        return size - map._size;
+    }
+};
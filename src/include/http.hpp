@@ -0,0 +1,255 @@
+#pragma once
+
+#include "utils.hpp"
+
+namespace http
+{
+    /**
+     * @brief An error to report to the client with an HTTP status code.
+     */
+    class HTTPError : public std::runtime_error
+    {
+    public:
+        const int status;
+
+        HTTPError(int status, const std::string &message) : std::runtime_error(message), status(status) {}
+    };
+
+    /**
+     * @brief A parsed HTTP/1.x request, viewing the buffer it was parsed from.
+     */
+    struct Request
+    {
+        std::string_view method, path, body;
+        bool keep_alive = true;
+    };
+
+    /**
+     * @brief Case-insensitive comparison of ASCII strings.
+     */
+    bool iequals(std::string_view lhs, std::string_view rhs)
+    {
+        return std::equal(
+            lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+            [](char a, char b)
+            { return std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b)); });
+    }
+
+    std::string_view trim(std::string_view value)
+    {
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+        {
+            value.remove_prefix(1);
+        }
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+        {
+            value.remove_suffix(1);
+        }
+
+        return value;
+    }
+
+    /**
+     * @brief Parse the first request of a buffer.
+     *
+     * @param buffer The bytes received so far.
+     * @param request The request to write to, valid as long as the buffer is.
+     * @param max_body_size The maximum size of a request body.
+     * @return The size of the request, or `0` if it is not complete yet.
+     * @throw HTTPError If the request is malformed or too large.
+     */
+    std::size_t parse_request(std::string_view buffer, Request &request, std::size_t max_body_size)
+    {
+        constexpr std::size_t MAX_HEADER_SIZE = 1 << 13;
+
+        const auto header_end = buffer.find("\r\n\r\n");
+        if (header_end == std::string_view::npos)
+        {
+            if (buffer.size() > MAX_HEADER_SIZE)
+            {
+                throw HTTPError(431, "Request Header Fields Too Large");
+            }
+
+            return 0;
+        }
+
+        auto headers = buffer.substr(0, header_end + 2);
+        const auto line_end = headers.find("\r\n");
+        const auto line = headers.substr(0, line_end);
+        headers.remove_prefix(line_end + 2);
+
+        // Request line: method, target and version separated by single spaces
+        const auto first_space = line.find(' '), last_space = line.rfind(' ');
+        if (first_space == std::string_view::npos || first_space == last_space)
+        {
+            throw HTTPError(400, "Bad Request");
+        }
+
+        const auto version = line.substr(last_space + 1);
+        if (version == "HTTP/1.1")
+        {
+            request.keep_alive = true;
+        }
+        else if (version == "HTTP/1.0")
+        {
+            request.keep_alive = false;
+        }
+        else
+        {
+            throw HTTPError(505, "HTTP Version Not Supported");
+        }
+
+        request.method = line.substr(0, first_space);
+        request.path = line.substr(first_space + 1, last_space - first_space - 1);
+        request.path = request.path.substr(0, request.path.find('?'));
+
+        std::size_t content_length = 0;
+        while (!headers.empty())
+        {
+            const auto end = headers.find("\r\n");
+            const auto header = headers.substr(0, end);
+            headers.remove_prefix(end + 2);
+
+            const auto colon = header.find(':');
+            if (colon == std::string_view::npos)
+            {
+                throw HTTPError(400, "Bad Request");
+            }
+
+            const auto name = header.substr(0, colon), value = trim(header.substr(colon + 1));
+            if (iequals(name, "Content-Length"))
+            {
+                const auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), content_length);
+                if (ec != std::errc() || ptr != value.data() + value.size())
+                {
+                    throw HTTPError(400, "Bad Request");
+                }
+            }
+            else if (iequals(name, "Transfer-Encoding"))
+            {
+                throw HTTPError(501, "Not Implemented");
+            }
+            else if (iequals(name, "Connection"))
+            {
+                if (iequals(value, "close"))
+                {
+                    request.keep_alive = false;
+                }
+                else if (iequals(value, "keep-alive"))
+                {
+                    request.keep_alive = true;
+                }
+            }
+        }
+
+        if (content_length > max_body_size)
+        {
+            throw HTTPError(413, "Request Entity Too Large");
+        }
+
+        const auto body_begin = header_end + 4;
+        if (buffer.size() < body_begin + content_length)
+        {
+            return 0;
+        }
+
+        request.body = buffer.substr(body_begin, content_length);
+        return body_begin + content_length;
+    }
+
+    /**
+     * @brief Decode a component of an `application/x-www-form-urlencoded` string.
+     *
+     * @throw HTTPError If a percent-encoded byte is malformed.
+     */
+    std::string url_decode(std::string_view value)
+    {
+        std::string result;
+        result.reserve(value.size());
+        for (std::size_t i = 0; i < value.size(); i++)
+        {
+            if (value[i] == '+')
+            {
+                result.push_back(' ');
+            }
+            else if (value[i] == '%')
+            {
+                unsigned int byte = 0;
+                const auto [ptr, ec] = i + 2 < value.size()
+                                           ? std::from_chars(value.data() + i + 1, value.data() + i + 3, byte, 16)
+                                           : std::from_chars_result{nullptr, std::errc::invalid_argument};
+                if (ec != std::errc() || ptr != value.data() + i + 3)
+                {
+                    throw HTTPError(400, "Bad Request");
+                }
+
+                result.push_back(static_cast<char>(byte));
+                i += 2;
+            }
+            else
+            {
+                result.push_back(value[i]);
+            }
+        }
+
+        return result;
+    }
+
+    /**
+     * @brief Parse an `application/x-www-form-urlencoded` body, later fields take precedence.
+     */
+    std::unordered_map<std::string, std::string> parse_form(std::string_view body)
+    {
+        std::unordered_map<std::string, std::string> form;
+        while (!body.empty())
+        {
+            const auto end = std::min(body.find('&'), body.size());
+            const auto field = body.substr(0, end);
+            body.remove_prefix(std::min(end + 1, body.size()));
+
+            const auto equal = std::min(field.find('='), field.size());
+            form[url_decode(field.substr(0, equal))] = url_decode(field.substr(std::min(equal + 1, field.size())));
+        }
+
+        return form;
+    }
+
+    const char *reason(int status)
+    {
+        switch (status)
+        {
+        case 200:
+            return "OK";
+        case 400:
+            return "Bad Request";
+        case 404:
+            return "Not Found";
+        case 405:
+            return "Method Not Allowed";
+        case 413:
+            return "Request Entity Too Large";
+        case 431:
+            return "Request Header Fields Too Large";
+        case 501:
+            return "Not Implemented";
+        case 505:
+            return "HTTP Version Not Supported";
+        default:
+            return "Internal Server Error";
+        }
+    }
+
+    /**
+     * @brief Append a complete HTTP/1.1 response to an output buffer.
+     */
+    void write_response(std::string &output, int status, std::string_view content_type, std::string_view body, bool keep_alive)
+    {
+        output += utils::format(
+            "HTTP/1.1 %d %s\r\nContent-Type: %.*s\r\nContent-Length: %zu\r\nConnection: %s\r\n\r\n",
+            status, reason(status),
+            static_cast<int>(content_type.size()), content_type.data(),
+            body.size(),
+            keep_alive ? "keep-alive" : "close");
+        output += body;
+    }
+}
@@ -0,0 +1,588 @@
+#pragma once
+
+#include "data.hpp"
+#include "distance.hpp"
+#include "model.hpp"
+#include "thread_pool.hpp"
+#include "utils.hpp"
+
+/**
+ * @brief The model shared by all inference calls of the process, see `initialize`.
+ */
+inline Model model;
+
+/**
+ * @brief Load the model shared by all inference calls of the process.
+ *
+ * This replaces `model` without any synchronization, so it must not run concurrently with
+ * inference, e.g. while tasks of `inference_pool()` are pending.
+ */
+void initialize(
+    const std::optional<std::string> &frequency_path,
+    const std::optional<std::string> &wordlist_path,
+    const std::optional<std::string> &model_path)
+{
+    if (model_path.has_value())
+    {
+        // Map the binary model directly, no parsing required
+        model = Model(*model_path);
+        return;
+    }
+
+    if (!frequency_path.has_value() || !wordlist_path.has_value())
+    {
+        throw std::invalid_argument("Either a model file or both frequency and wordlist files must be provided");
+    }
+
+    // The wordlist is loaded concurrently with the bigrams
+    auto words = std::async(std::launch::async, read_wordlist, *wordlist_path);
+
+    Vocabulary vocabulary;
+    std::vector<std::pair<uint64_t, unsigned int>> tuples;
+    read_frequency(*frequency_path, vocabulary, tuples);
+
+    model = Model(build_model(vocabulary, tuples, words.get(), 0, 0));
+}
+
+std::string inference(
+    const std::string &input,
+    const std::size_t &edit_distance_threshold,
+    const std::size_t &max_candidates_per_token,
+    const double &edit_penalty_factor)
+{
+    std::vector<std::string> tokens;
+    std::stringstream input_buf(input), output;
+
+    const auto process_tokens = [&](bool prepend_space) -> bool
+    {
+        // std::cerr << "Processing " << tokens << std::endl;
+        if (tokens.empty())
+        {
+            return false;
+        }
+
+        // Get the first and last byte of the token group.
+        // If they're not tokenizable char, they must be in the ASCII range.
+        auto first_char = tokens.front().front();
+        auto last_char = tokens.back().back();
+
+        bool first_valid = is_tokenizable_char(first_char);
+        bool last_valid = is_tokenizable_char(last_char);
+
+        if (!first_valid)
+        {
+            // We will have to prepend `first_char` later.
+            tokens.front().erase(0, 1);
+        }
+        if (!last_valid)
+        {
+            // We will have to append `last_char` later.
+            tokens.back().pop_back();
+        }
+
+        std::vector<std::string> lowercase(tokens);
+        for (auto &token : lowercase)
+        {
+            utils::to_lower(token);
+        }
+
+        // std::cerr << "lowercase = " << lowercase << std::endl;
+
+        std::vector<std::vector<std::size_t>> combined;
+        combine_tokens(lowercase, model.words, combined);
+        // std::cerr << "combined = " << combined << std::endl;
+
+        std::vector<bool> inspection(tokens.size());
+        for (const auto &indices : combined)
+        {
+            if (indices.size() == 1)
+            {
+                inspection[indices[0]] = true;
+            }
+        }
+
+        // Types of token cases:
+        // 0 - first letter uppercase
+        // 1 - all uppercase
+        // 2 - the rest (treat as all lowercase)
+        std::vector<int> case_types(tokens.size(), -1);
+
+        // Calculate `case_types`
+        for (std::size_t i = 0; i < tokens.size(); i++)
+        {
+            if (inspection[i])
+            {
+                // std::cerr << "Calculating case type for \"" << tokens[i] << "\"..." << std::endl;
+                if (utils::is_upper(tokens[i].data()))
+                {
+                    // The first character is uppercase
+                    bool skip_first_flag = true, has_upper = false, all_upper = true;
+                    for (auto &c : tokens[i])
+                    {
+                        if (utils::is_utf8_char(&c))
+                        {
+                            if (skip_first_flag)
+                            {
+                                skip_first_flag = false;
+                                continue;
+                            }
+
+                            if (utils::is_upper(&c))
+                            {
+                                has_upper = true;
+                            }
+                            else
+                            {
+                                all_upper = false;
+                            }
+                        }
+                    }
+
+                    if (all_upper)
+                    {
+                        // All characters are uppercase
+                        case_types[i] = 1;
+                    }
+                    else if (has_upper)
+                    {
+                        // Not all characters are uppercase, but at least 1 of them is
+                        case_types[i] = 2;
+                    }
+                    else
+                    {
+                        // No uppercase characters
+                        case_types[i] = 0;
+                    }
+                }
+                else
+                {
+                    // The first character is lowercase, so the token clearly belongs to type 2
+                    case_types[i] = 2;
+                }
+            }
+        }
+
+        // std::cerr << "case_types = " << case_types << std::endl;
+
+        // Perform spell-checking in `lowercase`
+        // The best `max_candidates_per_token` candidates by (score, index), as a min-heap while scoring
+        std::vector<std::pair<double, uint32_t>> candidates;
+        const auto offer = [&candidates, &max_candidates_per_token](double score, uint32_t index)
+        {
+            if (candidates.size() < max_candidates_per_token)
+            {
+                candidates.emplace_back(score, index);
+                std::push_heap(candidates.begin(), candidates.end(), std::greater<>());
+            }
+            else if (!candidates.empty() && std::make_pair(score, index) > candidates.front())
+            {
+                std::pop_heap(candidates.begin(), candidates.end(), std::greater<>());
+                candidates.back() = std::make_pair(score, index);
+                std::push_heap(candidates.begin(), candidates.end(), std::greater<>());
+            }
+        };
+
+        std::vector<uint32_t> query_characters, lookup_tokens;
+        std::vector<std::span<const uint32_t>> candidate_characters;
+        std::vector<std::size_t> distances;
+
+        // The delete index is complete up to its own distance only, the BK-tree for any threshold
+        const bool use_deletes = !model.deletes.empty() && edit_distance_threshold <= model.deletes.distance();
+
+        // Without context, a token is only corrected by edits on less than a third of its characters,
+        // and all-uppercase tokens (e.g. acronyms) are kept as they are
+        const auto context_free_distance = [&](std::size_t i) -> std::size_t
+        {
+            const auto length = std::count_if(
+                lowercase[i].begin(), lowercase[i].end(),
+                [](char c)
+                { return (c & 0xC0) != 0x80; });
+
+            if (case_types[i] == 1 || length == 0)
+            {
+                return 0;
+            }
+
+            return std::min<std::size_t>(edit_distance_threshold, (length - 1) / 3);
+        };
+
+        // Context-free candidates from the BK-tree are searched in a single batch for the unknown tokens
+        // whose neighbors give no context before any correction, the others are searched on demand
+        std::vector<std::size_t> batch_slots(lowercase.size(), std::numeric_limits<std::size_t>::max());
+        std::vector<std::vector<uint32_t>> batch_results;
+        if (!use_deletes && !model.bk_tree.empty())
+        {
+            std::vector<std::vector<uint32_t>> batch_characters;
+            std::size_t batch_distance = 0;
+            for (std::size_t i = 0; i < lowercase.size(); i++)
+            {
+                if (!inspection[i] || context_free_distance(i) == 0 || model.find_token(lowercase[i]).has_value())
+                {
+                    continue;
+                }
+
+                const auto first = i > 0 ? model.find_token(lowercase[i - 1]) : std::nullopt;
+                const auto second = i + 1 < lowercase.size() ? model.find_token(lowercase[i + 1]) : std::nullopt;
+                if ((!first.has_value() || model.successors(*first).tokens.empty()) &&
+                    (!second.has_value() || model.predecessors(*second).tokens.empty()))
+                {
+                    batch_slots[i] = batch_characters.size();
+                    batch_distance = std::max(batch_distance, context_free_distance(i));
+                    utils::utf8_characters(lowercase[i], batch_characters.emplace_back());
+                }
+            }
+
+            const std::vector<std::span<const uint32_t>> batch_queries(batch_characters.begin(), batch_characters.end());
+            model.bk_tree.search(batch_queries, batch_distance, model.characters, batch_results);
+        }
+
+        for (std::size_t i = 0; i < lowercase.size(); i++)
+        {
+            if (inspection[i])
+            {
+                // Successors of the previous token and predecessors of the next one, sorted by index
+                Model::Neighbors left, right;
+                if (i > 0)
+                {
+                    auto first = model.find_token(lowercase[i - 1]);
+                    if (first.has_value())
+                    {
+                        left = model.successors(*first);
+                    }
+                }
+
+                if (i + 1 < lowercase.size())
+                {
+                    auto second = model.find_token(lowercase[i + 1]);
+                    if (second.has_value())
+                    {
+                        right = model.predecessors(*second);
+                    }
+                }
+
+                query_characters.clear();
+                utils::utf8_characters(lowercase[i], query_characters);
+
+                const auto current = model.find_token(lowercase[i]);
+                const double total_left = left.total, total_right = right.total;
+
+                candidates.clear();
+                if (left.tokens.empty() && right.tokens.empty())
+                {
+                    // Without any context, an unknown token is replaced by the most frequent token within the
+                    // distance allowed for it, with the same penalty per edit as other candidates
+                    const auto max_distance = context_free_distance(i);
+                    if (current.has_value() || max_distance == 0)
+                    {
+                        continue;
+                    }
+
+                    if (use_deletes)
+                    {
+                        model.deletes.lookup(query_characters, max_distance, lookup_tokens);
+                    }
+                    else if (batch_slots[i] < batch_results.size())
+                    {
+                        lookup_tokens.swap(batch_results[batch_slots[i]]);
+                    }
+                    else
+                    {
+                        model.bk_tree.search(query_characters, max_distance, model.characters, lookup_tokens);
+                    }
+
+                    candidate_characters.clear();
+                    for (auto token : lookup_tokens)
+                    {
+                        candidate_characters.push_back(model.characters[token]);
+                    }
+
+                    damerau_levenshtein(std::span<const uint32_t>(query_characters), candidate_characters, distances);
+
+                    // Ties are broken by index, as the lookups return tokens in no particular order
+                    std::pair<double, uint32_t> best(0.0, static_cast<uint32_t>(-1));
+                    for (std::size_t j = 0; j < lookup_tokens.size(); j++)
+                    {
+                        if (distances[j] <= max_distance)
+                        {
+                            const auto token = lookup_tokens[j];
+                            const auto frequency = static_cast<double>(model.successors(token).total + model.predecessors(token).total);
+                            best = std::max(best, std::make_pair(frequency * std::pow(edit_penalty_factor, distances[j]), token));
+                        }
+                    }
+
+                    if (best.second != static_cast<uint32_t>(-1))
+                    {
+                        lowercase[i] = model.tokens[best.second];
+                    }
+
+                    continue;
+                }
+                else if (left.tokens.empty())
+                {
+                    for (std::size_t j = 0; j < right.tokens.size(); j++)
+                    {
+                        offer(static_cast<double>(right.counts[j]) / total_right, right.tokens[j]);
+                    }
+                }
+                else if (right.tokens.empty())
+                {
+                    for (std::size_t j = 0; j < left.tokens.size(); j++)
+                    {
+                        offer(static_cast<double>(left.counts[j]) / total_left, left.tokens[j]);
+                    }
+                }
+                else
+                {
+                    // Merge-join of the 2 sorted lists, candidates missing on the right have a count of 0
+                    std::size_t k = 0;
+                    for (std::size_t j = 0; j < left.tokens.size(); j++)
+                    {
+                        const auto candidate = left.tokens[j];
+                        while (k < right.tokens.size() && right.tokens[k] < candidate)
+                        {
+                            k++;
+                        }
+
+                        const auto count = k < right.tokens.size() && right.tokens[k] == candidate ? right.counts[k] : 0;
+                        const auto x = static_cast<double>(left.counts[j]) / total_left;
+                        const auto y = static_cast<double>(count) / total_right;
+                        offer(utils::sqrt(x * y), candidate);
+                    }
+                }
+
+                // Best candidates first
+                std::sort_heap(candidates.begin(), candidates.end(), std::greater<>());
+
+                if (current.has_value() && !model.confusions.empty() && edit_distance_threshold <= model.confusions.distance())
+                {
+                    // Candidates outside of the confusion set of a known token are beyond the threshold
+                    distances.clear();
+                    for (const auto &[score, index] : candidates)
+                    {
+                        distances.push_back(model.confusions.distance(*current, index));
+                    }
+                }
+                else
+                {
+                    // Edit distances to all candidates in a single batch, on the pre-decoded tokens of the model
+                    candidate_characters.clear();
+                    for (const auto &[score, index] : candidates)
+                    {
+                        candidate_characters.push_back(model.characters[index]);
+                    }
+
+                    damerau_levenshtein(std::span<const uint32_t>(query_characters), candidate_characters, distances);
+                }
+
+                double max_fitness = std::numeric_limits<double>::min();
+                uint32_t result = static_cast<uint32_t>(-1);
+                for (std::size_t j = 0; j < candidates.size(); j++)
+                {
+                    const auto [score, index] = candidates[j];
+                    const auto d = distances[j];
+                    if (d > edit_distance_threshold)
+                    {
+                        continue;
+                    }
+
+                    auto fitness = static_cast<double>(score) * std::pow(edit_penalty_factor, d);
+                    // std::cerr << "Comparing \"" << lowercase[i] << "\" and \"" << word << "\" with d = " << d << ", score = " << score << std::endl;
+                    if (fitness > max_fitness)
+                    {
+                        max_fitness = fitness;
+                        result = index;
+                    }
+                }
+
+                if (result != static_cast<uint32_t>(-1))
+                {
+                    lowercase[i] = model.tokens[result];
+                }
+            }
+        }
+
+        // Replace incorrect tokens in `tokens` with the correct ones in `lowercase`
+        for (std::size_t i = 0; i < lowercase.size(); i++)
+        {
+            if (inspection[i])
+            {
+                tokens[i] = lowercase[i];
+                if (case_types[i] == 0)
+                {
+                    utils::capitalize(tokens[i].data());
+                }
+                else if (case_types[i] == 1)
+                {
+                    for (auto &c : tokens[i])
+                    {
+                        if (utils::is_utf8_char(&c))
+                        {
+                            utils::capitalize(&c);
+                        }
+                    }
+                }
+            }
+        }
+
+        if (!first_valid)
+        {
+            tokens.front().insert(0, 1, first_char);
+        }
+        if (!last_valid)
+        {
+            tokens.back().push_back(last_char);
+        }
+
+        if (prepend_space)
+        {
+            output << ' ';
+        }
+        output << tokens[0];
+        for (std::size_t i = 1; i < tokens.size(); i++)
+        {
+            output << ' ' << tokens[i];
+        }
+
+        tokens.clear();
+        return true;
+    };
+
+    std::string line, token;
+    while (std::getline(input_buf, line))
+    {
+        bool is_first_token_group = true;
+        std::istringstream buffer(line);
+        while (buffer >> token)
+        {
+            // `token` has at least 1 character
+            bool first_valid = is_tokenizable_char(token.front());
+            bool mid_valid = std::all_of(token.begin() + 1, token.end() - 1, is_tokenizable_char);
+            bool last_valid = is_tokenizable_char(token.back());
+
+            auto mask = (first_valid << 2) | (mid_valid << 1) | last_valid;
+            // std::cerr << "Examining \"" << token << "\", mask = " << first_valid << mid_valid << last_valid << std::endl;
+            if (mask == 0b111)
+            {
+                tokens.push_back(token);
+            }
+            else if (mask == 0b011)
+            {
+                if (process_tokens(!is_first_token_group))
+                {
+                    is_first_token_group = false;
+                }
+
+                tokens.push_back(token);
+            }
+            else
+            {
+                if (mask == 0b110)
+                {
+                    tokens.push_back(token);
+                }
+
+                if (process_tokens(!is_first_token_group))
+                {
+                    is_first_token_group = false;
+                }
+
+                if (mask != 0b110)
+                {
+                    if (!is_first_token_group)
+                    {
+                        output << ' ';
+                    }
+                    output << token;
+                    is_first_token_group = false;
+                }
+            }
+        }
+
+        if (!tokens.empty())
+        {
+            process_tokens(!is_first_token_group);
+        }
+
+        output << '\n';
+    }
+
+    return output.str();
+}
+
+/**
+ * @brief The pool running batch inference, shared by all calls.
+ */
+ThreadPool &inference_pool()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+/**
+ * @brief Split inputs into chunks of whole lines, which are corrected independently.
+ *
+ * Chunks are ordered by their rank within their input, so that the first chunks of all inputs
+ * come before the rest of a long one and short inputs do not wait behind it.
+ *
+ * @return The index of the input of each chunk, and the chunk itself.
+ */
+std::vector<std::pair<std::size_t, std::string_view>> split_lines(const std::vector<std::string> &inputs)
+{
+    constexpr std::size_t CHUNK_SIZE = 1 << 16;
+    std::vector<std::string_view> remaining(inputs.begin(), inputs.end());
+    std::vector<std::pair<std::size_t, std::string_view>> chunks;
+    for (bool found = true; found;)
+    {
+        found = false;
+        for (std::size_t i = 0; i < remaining.size(); i++)
+        {
+            auto &input = remaining[i];
+            if (!input.empty())
+            {
+                auto end = input.size() > CHUNK_SIZE ? input.find('\n', CHUNK_SIZE) : std::string_view::npos;
+                end = end == std::string_view::npos ? input.size() : end + 1;
+
+                chunks.emplace_back(i, input.substr(0, end));
+                input.remove_prefix(end);
+                found = true;
+            }
+        }
+    }
+
+    return chunks;
+}
+
+/**
+ * @brief Concatenate the outputs of the chunks of each input, see `split_lines`.
+ */
+std::vector<std::string> join_lines(
+    std::size_t input_count,
+    const std::vector<std::pair<std::size_t, std::string_view>> &chunks,
+    const std::vector<std::string> &outputs)
+{
+    std::vector<std::string> results(input_count);
+    for (std::size_t i = 0; i < chunks.size(); i++)
+    {
+        results[chunks[i].first] += outputs[i];
+    }
+
+    return results;
+}
+
+std::vector<std::string> inference_batch(
+    const std::vector<std::string> &inputs,
+    const std::size_t &edit_distance_threshold,
+    const std::size_t &max_candidates_per_token,
+    const double &edit_penalty_factor)
+{
+    const auto chunks = split_lines(inputs);
+    std::vector<std::string> outputs(chunks.size());
+    inference_pool().parallel_for(
+        chunks.size(),
+        [&](std::size_t i)
+        {
+            outputs[i] = inference(std::string(chunks[i].second), edit_distance_threshold, max_candidates_per_token, edit_penalty_factor);
+        });
+
+    return join_lines(inputs.size(), chunks, outputs);
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "utils.hpp"
+
+/**
+ * @brief A read-only memory mapping of a whole file.
+ */
+class MappedFile
+{
+private:
+    char *_data = nullptr;
+    std::size_t _size = 0;
+
+    void _map(int fd, const std::string &name, int advice)
+    {
+        struct stat64 stat_buf;
+        if (fstat64(fd, &stat_buf) == -1)
+        {
+            throw std::runtime_error(utils::format("Failed to read \"%s\"", name.c_str()));
+        }
+
+        _size = stat_buf.st_size;
+        if (_size > 0)
+        {
+            void *ptr = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+            if (ptr == MAP_FAILED)
+            {
+                throw std::runtime_error(utils::format("Failed to map \"%s\" into memory", name.c_str()));
+            }
+
+            _data = static_cast<char *>(ptr);
+            madvise(_data, _size, advice);
+        }
+    }
+
+public:
+    /**
+     * @brief Map a file into memory.
+     *
+     * @param path The path to the file.
+     * @param advice The access pattern to pass to `madvise`, e.g. `MADV_SEQUENTIAL`.
+     */
+    MappedFile(const std::string &path, int advice = MADV_NORMAL)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1)
+        {
+            throw std::runtime_error(utils::format("Failed to read \"%s\"", path.c_str()));
+        }
+
+        try
+        {
+            _map(fd, path, advice);
+        }
+        catch (...)
+        {
+            close(fd);
+            throw;
+        }
+
+        // The mapping stays valid after the descriptor is closed
+        close(fd);
+    }
+
+    /**
+     * @brief Map an open file into memory, e.g. a `memfd`. The descriptor is not closed.
+     *
+     * The mapping is read-only and shared, so that processes forked afterwards use the same physical
+     * pages.
+     */
+    MappedFile(int fd, const std::string &name, int advice = MADV_NORMAL)
+    {
+        _map(fd, name, advice);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        if (_data != nullptr)
+        {
+            munmap(_data, _size);
+        }
+    }
+
+    const char *data() const
+    {
+        return _data;
+    }
+
+    std::size_t size() const
+    {
+        return _size;
+    }
+
+    std::string_view view() const
+    {
+        return std::string_view(_data, _size);
+    }
+};
@@ -0,0 +1,619 @@
+#pragma once
+
+#include "bk_tree.hpp"
+#include "confusion.hpp"
+#include "delete_index.hpp"
+#include "mapped_file.hpp"
+#include "utils.hpp"
+#include "vocabulary.hpp"
+
+/**
+ * @brief Sections of a binary model file, in the order they are stored.
+ */
+enum ModelSection : uint32_t
+{
+    TOKEN_OFFSETS,       // uint32_t[token_count + 1]
+    TOKEN_BYTES,         // char[], concatenated tokens
+    TOKEN_ORDER,         // uint32_t[token_count], token indices sorted by their strings
+    CHARACTER_OFFSETS,   // uint64_t[token_count + 1], the range of characters of each token
+    CHARACTERS,          // uint32_t[], the characters of all tokens, see `utils::utf8_characters`
+    DELETE_DISTANCE,     // uint32_t[1], the maximum distance of the delete index
+    DELETE_OFFSETS,      // uint32_t[bucket_count + 1], the range of entries of each bucket of the delete index
+    DELETE_ENTRIES,      // uint64_t[], `(fingerprint << 32) | token`, see `DeleteIndex`
+    BK_TREE_TOKENS,      // uint32_t[token_count], the token of each node of the BK-tree in breadth-first order
+    BK_TREE_DISTANCES,   // uint32_t[token_count], the distance from each node of the BK-tree to its parent
+    BK_TREE_OFFSETS,     // uint32_t[token_count + 1], the range of children of each node of the BK-tree
+    CONFUSION_DISTANCE,  // uint32_t[1], the maximum distance of the confusion sets
+    CONFUSION_OFFSETS,   // uint64_t[token_count + 1], the range of the confusion set of each token
+    CONFUSION_TOKENS,    // uint32_t[], the tokens of each confusion set in ascending order, without the token itself
+    CONFUSION_DISTANCES, // uint8_t[], the distance to each token of each confusion set
+    FORWARD_OFFSETS,     // uint64_t[token_count + 1], the range of successors of each token
+    FORWARD_TOKENS,      // uint32_t[bigram_count], the successors of each token in ascending order
+    FORWARD_COUNTS,      // uint32_t[bigram_count]
+    FORWARD_TOTALS,      // uint64_t[token_count], the sum of the counts of the successors of each token
+    BACKWARD_OFFSETS,    // uint64_t[token_count + 1], the range of predecessors of each token
+    BACKWARD_TOKENS,     // uint32_t[bigram_count], the predecessors of each token in ascending order
+    BACKWARD_COUNTS,     // uint32_t[bigram_count]
+    BACKWARD_TOTALS,     // uint64_t[token_count], the sum of the counts of the predecessors of each token
+    WORD_OFFSETS,        // uint32_t[word_count + 1]
+    WORD_BYTES,          // char[], concatenated words in sorted order
+    SECTION_COUNT,
+};
+
+constexpr char MODEL_MAGIC[8] = {'V', 'N', 'S', 'P', 'E', 'L', 'L', '\0'};
+constexpr uint32_t MODEL_VERSION = 8;
+
+/**
+ * @brief Header of a binary model file.
+ *
+ * All sections are 8-byte aligned and stored in native byte order, so that the file can be
+ * memory-mapped and used without any parsing.
+ */
+struct ModelHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+    struct
+    {
+        uint64_t offset;
+        uint64_t size;
+    } sections[SECTION_COUNT];
+};
+
+/**
+ * @brief Check if a file starts with the magic bytes of a binary model file.
+ */
+bool is_model_file(const std::string &path)
+{
+    char magic[sizeof(MODEL_MAGIC)];
+    std::fstream input(path, std::ios::in | std::ios::binary);
+    return input.read(magic, sizeof(magic)) && std::memcmp(magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) == 0;
+}
+
+/**
+ * @brief A read-only view of strings stored as an offsets array and concatenated bytes.
+ */
+class StringTable
+{
+private:
+    std::span<const uint32_t> _offsets;
+    const char *_bytes = nullptr;
+
+public:
+    StringTable() = default;
+    StringTable(std::span<const uint32_t> offsets, const char *bytes) : _offsets(offsets), _bytes(bytes) {}
+
+    std::size_t size() const
+    {
+        return _offsets.empty() ? 0 : _offsets.size() - 1;
+    }
+
+    std::string_view operator[](std::size_t index) const
+    {
+        return std::string_view(_bytes + _offsets[index], _offsets[index + 1] - _offsets[index]);
+    }
+
+    /**
+     * @brief Check if a string is present, assuming that the table is sorted.
+     */
+    bool contains(std::string_view str) const
+    {
+        std::size_t low = 0, high = size();
+        while (low < high)
+        {
+            auto mid = (low + high) / 2;
+            if ((*this)[mid] < str)
+            {
+                low = mid + 1;
+            }
+            else
+            {
+                high = mid;
+            }
+        }
+
+        return low < size() && (*this)[low] == str;
+    }
+};
+
+/**
+ * @brief A read-only view of strings of characters (see `utils::utf8_characters`), stored as an
+ * offsets array and concatenated characters.
+ */
+class CharacterTable
+{
+private:
+    std::span<const uint64_t> _offsets;
+    std::span<const uint32_t> _characters;
+
+public:
+    CharacterTable() = default;
+    CharacterTable(std::span<const uint64_t> offsets, std::span<const uint32_t> characters) : _offsets(offsets), _characters(characters) {}
+
+    std::size_t size() const
+    {
+        return _offsets.empty() ? 0 : _offsets.size() - 1;
+    }
+
+    std::span<const uint32_t> operator[](std::size_t index) const
+    {
+        return _characters.subspan(_offsets[index], _offsets[index + 1] - _offsets[index]);
+    }
+};
+
+/**
+ * @brief Serializer for binary model files.
+ */
+class ModelBuilder
+{
+private:
+    std::array<std::vector<char>, SECTION_COUNT> _sections;
+
+    static std::size_t _align(std::size_t offset)
+    {
+        return (offset + 7) & ~static_cast<std::size_t>(7);
+    }
+
+public:
+    template <typename T>
+    void set(ModelSection section, std::span<const T> data)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        auto &bytes = _sections[section];
+        bytes.resize(data.size_bytes());
+        std::memcpy(bytes.data(), data.data(), data.size_bytes());
+    }
+
+    template <typename T>
+    void set(ModelSection section, const std::vector<T> &data)
+    {
+        set(section, std::span<const T>(data));
+    }
+
+    /**
+     * @brief Store a string table, e.g. from a `std::vector<std::string>` or a `Vocabulary`.
+     */
+    template <typename _Strings>
+    void set_strings(ModelSection offsets_section, ModelSection bytes_section, const _Strings &strings)
+    {
+        std::vector<uint32_t> offsets = {0};
+        std::vector<char> bytes;
+        for (std::size_t i = 0; i < strings.size(); i++)
+        {
+            std::string_view str = strings[i];
+            bytes.insert(bytes.end(), str.begin(), str.end());
+            if (bytes.size() > std::numeric_limits<uint32_t>::max())
+            {
+                throw std::overflow_error("String table exceeds 4GiB");
+            }
+
+            offsets.push_back(bytes.size());
+        }
+
+        set(offsets_section, offsets);
+        _sections[bytes_section] = std::move(bytes);
+    }
+
+    /**
+     * @brief The total size of the serialized model in bytes.
+     */
+    std::size_t size() const
+    {
+        std::size_t offset = _align(sizeof(ModelHeader));
+        for (const auto &bytes : _sections)
+        {
+            offset = _align(offset + bytes.size());
+        }
+
+        return offset;
+    }
+
+    /**
+     * @brief Serialize the model into a zero-initialized buffer of at least `size()` bytes.
+     */
+    void serialize(char *dest) const
+    {
+        ModelHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+        header.version = MODEL_VERSION;
+        header.section_count = SECTION_COUNT;
+
+        std::size_t offset = _align(sizeof(ModelHeader));
+        for (std::size_t i = 0; i < SECTION_COUNT; i++)
+        {
+            header.sections[i].offset = offset;
+            header.sections[i].size = _sections[i].size();
+            std::memcpy(dest + offset, _sections[i].data(), _sections[i].size());
+
+            offset = _align(offset + _sections[i].size());
+        }
+
+        std::memcpy(dest, &header, sizeof(header));
+    }
+
+    void save(const std::string &path) const
+    {
+        std::vector<char> buffer(size());
+        serialize(buffer.data());
+
+        std::fstream output(path, std::ios::out | std::ios::binary);
+        if (!output.write(buffer.data(), buffer.size()))
+        {
+            throw std::runtime_error(utils::format("Failed to write \"%s\"", path.c_str()));
+        }
+    }
+};
+
+/**
+ * @brief Build the sections of a model.
+ *
+ * @param tokens The tokens, indexed by their indices.
+ * @param tuples The bigram counts, sorted by `(first << 32) | second`.
+ * @param words The wordlist, sorted.
+ * @param delete_distance The maximum distance of the delete index, `0` to leave it empty.
+ * @param confusion_distance The maximum distance of the confusion sets, `0` to leave them empty. Their
+ * size grows quickly with the distance, so they are opt-in.
+ */
+ModelBuilder build_model(
+    const Vocabulary &tokens,
+    const std::vector<std::pair<uint64_t, unsigned int>> &tuples,
+    const std::vector<std::string> &words,
+    std::size_t delete_distance = 2,
+    std::size_t confusion_distance = 0)
+{
+    ModelBuilder builder;
+    builder.set_strings(TOKEN_OFFSETS, TOKEN_BYTES, tokens);
+
+    std::vector<uint32_t> order(tokens.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(
+        std::execution::par, order.begin(), order.end(),
+        [&tokens](uint32_t lhs, uint32_t rhs)
+        { return tokens[lhs] < tokens[rhs]; });
+    builder.set(TOKEN_ORDER, order);
+
+    // Tokens decoded once, so that edit distances never parse UTF-8 at inference time
+    std::vector<uint64_t> character_offsets = {0};
+    std::vector<uint32_t> characters;
+    for (std::size_t i = 0; i < tokens.size(); i++)
+    {
+        utils::utf8_characters(tokens[i], characters);
+        character_offsets.push_back(characters.size());
+    }
+    builder.set(CHARACTER_OFFSETS, character_offsets);
+    builder.set(CHARACTERS, characters);
+
+    const CharacterTable character_table(character_offsets, characters);
+
+    std::vector<uint32_t> delete_offsets;
+    std::vector<uint64_t> delete_entries;
+    if (delete_distance > 0)
+    {
+        build_delete_index(character_table, delete_distance, delete_offsets, delete_entries);
+    }
+    builder.set(DELETE_DISTANCE, std::vector<uint32_t>{static_cast<uint32_t>(delete_distance)});
+    builder.set(DELETE_OFFSETS, delete_offsets);
+    builder.set(DELETE_ENTRIES, delete_entries);
+
+    // Confusion sets are found with the delete index, or a temporary one if it is not deep enough
+    std::vector<uint64_t> confusion_offsets;
+    std::vector<uint32_t> confusion_tokens;
+    std::vector<uint8_t> confusion_distances;
+    if (confusion_distance > 0)
+    {
+        if (confusion_distance <= delete_distance)
+        {
+            const DeleteIndex index(delete_distance, delete_offsets, delete_entries);
+            build_confusion_sets(character_table, index, confusion_distance, confusion_offsets, confusion_tokens, confusion_distances);
+        }
+        else
+        {
+            std::vector<uint32_t> offsets;
+            std::vector<uint64_t> entries;
+            build_delete_index(character_table, confusion_distance, offsets, entries);
+
+            const DeleteIndex index(confusion_distance, offsets, entries);
+            build_confusion_sets(character_table, index, confusion_distance, confusion_offsets, confusion_tokens, confusion_distances);
+        }
+    }
+    builder.set(CONFUSION_DISTANCE, std::vector<uint32_t>{static_cast<uint32_t>(confusion_distance)});
+    builder.set(CONFUSION_OFFSETS, confusion_offsets);
+    builder.set(CONFUSION_TOKENS, confusion_tokens);
+    builder.set(CONFUSION_DISTANCES, confusion_distances);
+
+    std::vector<uint32_t> bk_tree_tokens, bk_tree_distances, bk_tree_offsets;
+    build_bk_tree(character_table, bk_tree_tokens, bk_tree_distances, bk_tree_offsets);
+    builder.set(BK_TREE_TOKENS, bk_tree_tokens);
+    builder.set(BK_TREE_DISTANCES, bk_tree_distances);
+    builder.set(BK_TREE_OFFSETS, bk_tree_offsets);
+
+    // Compressed sparse rows of the bigrams, indexed by their first token
+    const auto set_adjacency = [&builder, &tokens](
+                                   ModelSection offsets_section, ModelSection tokens_section,
+                                   ModelSection counts_section, ModelSection totals_section,
+                                   const std::vector<std::pair<uint64_t, unsigned int>> &sorted)
+    {
+        std::vector<uint64_t> offsets(tokens.size() + 1), totals(tokens.size());
+        std::vector<uint32_t> neighbors(sorted.size()), counts(sorted.size());
+        for (std::size_t i = 0; i < sorted.size(); i++)
+        {
+            const auto token = sorted[i].first >> 32;
+            offsets[token + 1]++;
+            totals[token] += sorted[i].second;
+            neighbors[i] = sorted[i].first & 0xFFFFFFFF;
+            counts[i] = sorted[i].second;
+        }
+        std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+        builder.set(offsets_section, offsets);
+        builder.set(tokens_section, neighbors);
+        builder.set(counts_section, counts);
+        builder.set(totals_section, totals);
+    };
+
+    set_adjacency(FORWARD_OFFSETS, FORWARD_TOKENS, FORWARD_COUNTS, FORWARD_TOTALS, tuples);
+
+    std::vector<std::pair<uint64_t, unsigned int>> backward;
+    backward.reserve(tuples.size());
+    for (const auto &[mask, freq] : tuples)
+    {
+        backward.emplace_back(std::rotl(mask, 32), freq);
+    }
+    std::sort(std::execution::par, backward.begin(), backward.end());
+
+    set_adjacency(BACKWARD_OFFSETS, BACKWARD_TOKENS, BACKWARD_COUNTS, BACKWARD_TOTALS, backward);
+
+    builder.set_strings(WORD_OFFSETS, WORD_BYTES, words);
+    return builder;
+}
+
+/**
+ * @brief A read-only spell-checking model, memory-mapped from a binary model file or from a sealed
+ * anonymous file it was serialized into.
+ *
+ * All sections are addressed by offsets from the start of the mapping, so the same pages can be
+ * mapped at any address. Processes forked after loading share a single physical copy.
+ */
+class Model
+{
+public:
+    /**
+     * @brief The neighbors of a token in ascending order, with the counts of their bigrams.
+     */
+    struct Neighbors
+    {
+        std::span<const uint32_t> tokens;
+        std::span<const uint32_t> counts;
+        uint64_t total = 0; // The sum of `counts`
+    };
+
+private:
+    struct _Adjacency
+    {
+        std::span<const uint64_t> offsets;
+        std::span<const uint32_t> tokens;
+        std::span<const uint32_t> counts;
+        std::span<const uint64_t> totals;
+
+        Neighbors operator[](uint32_t token) const
+        {
+            const auto begin = offsets[token], length = offsets[token + 1] - begin;
+            return Neighbors{tokens.subspan(begin, length), counts.subspan(begin, length), totals[token]};
+        }
+    };
+
+    std::unique_ptr<MappedFile> _file;
+    _Adjacency _forward, _backward;
+
+    template <typename T>
+    static std::span<const T> _section(const char *data, std::size_t size, const ModelHeader &header, ModelSection section)
+    {
+        const auto &[offset, length] = header.sections[section];
+        if (offset > size || length > size - offset || offset % alignof(T) != 0 || length % sizeof(T) != 0)
+        {
+            throw std::runtime_error(utils::format("Corrupted section %u in model file", static_cast<unsigned int>(section)));
+        }
+
+        return std::span<const T>(reinterpret_cast<const T *>(data + offset), length / sizeof(T));
+    }
+
+    void _load(const char *data, std::size_t size)
+    {
+        if (size < sizeof(ModelHeader))
+        {
+            throw std::runtime_error("Model file is too small");
+        }
+
+        const auto &header = *reinterpret_cast<const ModelHeader *>(data);
+        if (std::memcmp(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) != 0)
+        {
+            throw std::runtime_error("Not a model file");
+        }
+
+        if (header.version != MODEL_VERSION || header.section_count != SECTION_COUNT)
+        {
+            throw std::runtime_error(utils::format("Unsupported model version %u (expected %u)", header.version, MODEL_VERSION));
+        }
+
+        tokens = StringTable(_section<uint32_t>(data, size, header, TOKEN_OFFSETS), data + header.sections[TOKEN_BYTES].offset);
+        token_order = _section<uint32_t>(data, size, header, TOKEN_ORDER);
+        const auto character_offsets = _section<uint64_t>(data, size, header, CHARACTER_OFFSETS);
+        const auto character_data = _section<uint32_t>(data, size, header, CHARACTERS);
+        characters = CharacterTable(character_offsets, character_data);
+
+        const auto delete_distance = _section<uint32_t>(data, size, header, DELETE_DISTANCE);
+        const auto delete_offsets = _section<uint32_t>(data, size, header, DELETE_OFFSETS);
+        const auto delete_entries = _section<uint64_t>(data, size, header, DELETE_ENTRIES);
+        if (delete_distance.size() != 1 ||
+            (!delete_entries.empty() && (delete_offsets.size() < 2 ||
+                                         !std::has_single_bit(delete_offsets.size() - 1) ||
+                                         delete_offsets.back() != delete_entries.size())))
+        {
+            throw std::runtime_error("Corrupted delete index in model file");
+        }
+        deletes = DeleteIndex(delete_distance[0], delete_offsets, delete_entries);
+
+        bk_tree = BKTree(
+            _section<uint32_t>(data, size, header, BK_TREE_TOKENS),
+            _section<uint32_t>(data, size, header, BK_TREE_DISTANCES),
+            _section<uint32_t>(data, size, header, BK_TREE_OFFSETS));
+        if (!bk_tree.valid())
+        {
+            throw std::runtime_error("Corrupted BK-tree in model file");
+        }
+
+        const auto confusion_distance = _section<uint32_t>(data, size, header, CONFUSION_DISTANCE);
+        const auto confusion_offsets = _section<uint64_t>(data, size, header, CONFUSION_OFFSETS);
+        const auto confusion_tokens = _section<uint32_t>(data, size, header, CONFUSION_TOKENS);
+        const auto confusion_distances = _section<uint8_t>(data, size, header, CONFUSION_DISTANCES);
+        if (confusion_distance.size() != 1 ||
+            confusion_distances.size() != confusion_tokens.size() ||
+            (!confusion_offsets.empty() && (confusion_offsets.size() != tokens.size() + 1 ||
+                                            confusion_offsets.back() != confusion_tokens.size())))
+        {
+            throw std::runtime_error("Corrupted confusion sets in model file");
+        }
+        confusions = ConfusionSets(confusion_distance[0], confusion_offsets, confusion_tokens, confusion_distances);
+        _forward = {
+            _section<uint64_t>(data, size, header, FORWARD_OFFSETS),
+            _section<uint32_t>(data, size, header, FORWARD_TOKENS),
+            _section<uint32_t>(data, size, header, FORWARD_COUNTS),
+            _section<uint64_t>(data, size, header, FORWARD_TOTALS)};
+        _backward = {
+            _section<uint64_t>(data, size, header, BACKWARD_OFFSETS),
+            _section<uint32_t>(data, size, header, BACKWARD_TOKENS),
+            _section<uint32_t>(data, size, header, BACKWARD_COUNTS),
+            _section<uint64_t>(data, size, header, BACKWARD_TOTALS)};
+        words = StringTable(_section<uint32_t>(data, size, header, WORD_OFFSETS), data + header.sections[WORD_BYTES].offset);
+
+        const auto consistent = [this](const _Adjacency &adjacency)
+        {
+            return adjacency.offsets.size() == tokens.size() + 1 &&
+                   adjacency.offsets.front() == 0 &&
+                   adjacency.offsets.back() == adjacency.tokens.size() &&
+                   adjacency.counts.size() == adjacency.tokens.size() &&
+                   adjacency.totals.size() == tokens.size();
+        };
+
+        if (token_order.size() != tokens.size() ||
+            character_offsets.size() != tokens.size() + 1 ||
+            character_offsets.back() != character_data.size() ||
+            bk_tree.size() != tokens.size() ||
+            !consistent(_forward) || !consistent(_backward))
+        {
+            throw std::runtime_error("Inconsistent section sizes in model file");
+        }
+    }
+
+public:
+    StringTable tokens;
+    std::span<const uint32_t> token_order;
+    CharacterTable characters;
+    StringTable words;
+    DeleteIndex deletes;
+    BKTree bk_tree;
+    ConfusionSets confusions;
+
+    Model() = default;
+
+    /**
+     * @brief Map a binary model file into memory.
+     */
+    explicit Model(const std::string &path) : _file(std::make_unique<MappedFile>(path, MADV_RANDOM))
+    {
+        _load(_file->data(), _file->size());
+    }
+
+    /**
+     * @brief Serialize a model into a `memfd`, which is sealed and then mapped read-only like a model
+     * file. The mapping is only shared with processes forked afterwards, others must load a model
+     * file to share its pages through the page cache.
+     */
+    explicit Model(const ModelBuilder &builder)
+    {
+        const int fd = memfd_create("model", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd == -1)
+        {
+            throw std::runtime_error(utils::format("Failed to create memfd: %s", std::strerror(errno)));
+        }
+
+        try
+        {
+            const auto size = builder.size();
+            if (ftruncate(fd, size) == -1)
+            {
+                throw std::runtime_error(utils::format("Failed to allocate %s for the model: %s", utils::memory_size(size).c_str(), std::strerror(errno)));
+            }
+
+            // A fresh memfd is zero-filled, as required by `serialize`
+            void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (ptr == MAP_FAILED)
+            {
+                throw std::runtime_error(utils::format("Failed to map memfd: %s", std::strerror(errno)));
+            }
+
+            builder.serialize(static_cast<char *>(ptr));
+            munmap(ptr, size);
+
+            // Sealing fails while a writable mapping exists
+            if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1)
+            {
+                throw std::runtime_error(utils::format("Failed to seal memfd: %s", std::strerror(errno)));
+            }
+
+            _file = std::make_unique<MappedFile>(fd, "memfd:model", MADV_RANDOM);
+        }
+        catch (...)
+        {
+            close(fd);
+            throw;
+        }
+
+        close(fd);
+        _load(_file->data(), _file->size());
+    }
+
+    /**
+     * @brief The number of distinct bigrams.
+     */
+    std::size_t bigram_count() const
+    {
+        return _forward.tokens.size();
+    }
+
+    /**
+     * @brief The tokens following `token` in a bigram.
+     */
+    Neighbors successors(uint32_t token) const
+    {
+        return _forward[token];
+    }
+
+    /**
+     * @brief The tokens preceding `token` in a bigram.
+     */
+    Neighbors predecessors(uint32_t token) const
+    {
+        return _backward[token];
+    }
+
+    /**
+     * @brief Find the index of a token.
+     */
+    std::optional<uint32_t> find_token(std::string_view token) const
+    {
+        auto iter = std::lower_bound(
+            token_order.begin(), token_order.end(), token,
+            [this](uint32_t index, std::string_view value)
+            { return tokens[index] < value; });
+
+        if (iter != token_order.end() && tokens[*iter] == token)
+        {
+            return *iter;
+        }
+
+        return std::nullopt;
+    }
+};
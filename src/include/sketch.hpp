@@ -0,0 +1,103 @@
+#pragma once
+
+#include "utils.hpp"
+
+/**
+ * @brief Count-Min sketch over 64-bit keys, safe for concurrent updates.
+ *
+ * Estimates never undercount. With width `w` and depth `d`, an estimate exceeds the true count
+ * by more than `e / w * N` (where `N` is the total count) with probability at most `e^-d`.
+ */
+class CountMinSketch
+{
+private:
+    std::size_t _width, _depth;
+    std::vector<std::atomic<uint32_t>> _cells;
+
+    std::size_t _index(uint64_t key, std::size_t row) const
+    {
+        return row * _width + (utils::hash64(key + row * 0x9e3779b97f4a7c15ULL) & (_width - 1));
+    }
+
+public:
+    /**
+     * @param memory The memory budget in bytes, the width is the largest power of 2 that fits.
+     * @param depth The number of rows (hash functions).
+     */
+    CountMinSketch(std::size_t memory, std::size_t depth = 5) : _width(1), _depth(depth)
+    {
+        while (2 * _width * _depth * sizeof(uint32_t) <= memory)
+        {
+            _width *= 2;
+        }
+
+        _cells = std::vector<std::atomic<uint32_t>>(_width * _depth);
+    }
+
+    /**
+     * @brief Count occurrences of a key.
+     *
+     * @param key The key to count.
+     * @param count The number of occurrences.
+     * @return The estimated count of the key, including these occurrences.
+     */
+    uint32_t add(uint64_t key, uint32_t count = 1)
+    {
+        auto result = std::numeric_limits<uint32_t>::max();
+        for (std::size_t row = 0; row < _depth; row++)
+        {
+            result = std::min(result, _cells[_index(key, row)].fetch_add(count, std::memory_order_relaxed) + count);
+        }
+
+        return result;
+    }
+
+    /**
+     * @brief Estimate the count of a key.
+     */
+    uint32_t estimate(uint64_t key) const
+    {
+        auto result = std::numeric_limits<uint32_t>::max();
+        for (std::size_t row = 0; row < _depth; row++)
+        {
+            result = std::min(result, _cells[_index(key, row)].load(std::memory_order_relaxed));
+        }
+
+        return result;
+    }
+
+    /**
+     * @brief The total count of all keys.
+     */
+    unsigned long long total() const
+    {
+        unsigned long long result = 0;
+        for (std::size_t i = 0; i < _width; i++)
+        {
+            result += _cells[i].load(std::memory_order_relaxed);
+        }
+
+        return result;
+    }
+
+    std::size_t memory() const
+    {
+        return _cells.size() * sizeof(uint32_t);
+    }
+
+    /**
+     * @brief The relative error bound: estimates exceed the true count by at most `epsilon() * total()`...
+     */
+    double epsilon() const
+    {
+        return std::exp(1.0) / _width;
+    }
+
+    /**
+     * @brief ...with probability at least `1 - delta()`.
+     */
+    double delta() const
+    {
+        return std::exp(-static_cast<double>(_depth));
+    }
+};
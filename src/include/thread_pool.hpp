@@ -0,0 +1,244 @@
+#pragma once
+
+#include "utils.hpp"
+
+/**
+ * @brief A fixed-size pool of worker threads with work stealing.
+ *
+ * Tasks submitted from outside go to a shared queue and are served in order of submission, so
+ * that the oldest requests never wait behind newer ones. Each worker also owns a queue, holding
+ * its block of the range of a `parallel_for` and the tasks it submits itself. A worker runs the
+ * newest task of its own queue first, then the oldest task of the shared queue, and steals the
+ * oldest task of another worker when both are empty, so that a busy worker cannot hold back its
+ * block.
+ */
+class ThreadPool
+{
+private:
+    struct _Queue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    _Queue _injected;
+    std::deque<_Queue> _queues;
+    std::vector<std::thread> _workers;
+
+    // The number of queued tasks not yet claimed by a worker
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    std::size_t _pending = 0;
+    bool _stopped = false;
+
+    static thread_local const ThreadPool *_current_pool;
+    static thread_local std::size_t _current_index;
+
+    static bool _pop(_Queue &queue, bool back, std::function<void()> &task)
+    {
+        std::lock_guard lock(queue.mutex);
+        if (queue.tasks.empty())
+        {
+            return false;
+        }
+
+        if (back)
+        {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        else
+        {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Take a task, from the back of the queue of `index`, or from the front of the shared
+     * queue or of another one.
+     */
+    bool _take(std::size_t index, std::function<void()> &task)
+    {
+        if (_pop(_queues[index], true, task) || _pop(_injected, false, task))
+        {
+            return true;
+        }
+
+        for (std::size_t i = 1; i < _queues.size(); i++)
+        {
+            if (_pop(_queues[(index + i) % _queues.size()], false, task))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void _run(std::size_t index)
+    {
+        _current_pool = this;
+        _current_index = index;
+
+        std::function<void()> task;
+        while (true)
+        {
+            {
+                std::unique_lock lock(_mutex);
+                _condition.wait(lock, [this]()
+                                { return _stopped || _pending > 0; });
+                if (_pending == 0)
+                {
+                    return;
+                }
+
+                _pending--;
+            }
+
+            // A task has been claimed, it is in one of the queues
+            while (!_take(index, task))
+            {
+                std::this_thread::yield();
+            }
+
+            task();
+            task = nullptr;
+        }
+    }
+
+public:
+    /**
+     * @param threads The number of worker threads.
+     */
+    explicit ThreadPool(std::size_t threads = std::max(1u, std::thread::hardware_concurrency())) : _queues(threads)
+    {
+        for (std::size_t i = 0; i < threads; i++)
+        {
+            _workers.emplace_back(&ThreadPool::_run, this, i);
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool()
+    {
+        shutdown();
+    }
+
+    /**
+     * @brief Wait for all submitted tasks to complete, then stop the workers. Further submissions
+     * throw. This must not be called from a task of the same pool.
+     */
+    void shutdown()
+    {
+        {
+            std::lock_guard lock(_mutex);
+            _stopped = true;
+        }
+
+        _condition.notify_all();
+        for (auto &worker : _workers)
+        {
+            if (worker.joinable())
+            {
+                worker.join();
+            }
+        }
+    }
+
+    std::size_t size() const
+    {
+        return _workers.size();
+    }
+
+    /**
+     * @brief Queue a task. Exceptions must not escape from it.
+     */
+    void submit(std::function<void()> task)
+    {
+        {
+            // Workers only exit once no task is pending, so a task is either rejected here or run.
+            // Tasks of the workers may still submit while the pool drains.
+            std::lock_guard lock(_mutex);
+            if (_stopped && _current_pool != this)
+            {
+                throw std::runtime_error("Thread pool is shut down");
+            }
+
+            auto &queue = _current_pool == this ? _queues[_current_index] : _injected;
+            {
+                std::lock_guard queue_lock(queue.mutex);
+                queue.tasks.push_back(std::move(task));
+            }
+
+            _pending++;
+        }
+
+        _condition.notify_one();
+    }
+
+    /**
+     * @brief Run `function(i)` for each `i` in `[0, count)` on the pool and wait for all of them.
+     * This must not be called from a task of the same pool.
+     *
+     * @return The first exception thrown by `function`, rethrown once all calls have completed.
+     */
+    template <typename _Function>
+    void parallel_for(std::size_t count, _Function &&function)
+    {
+        std::latch done(count);
+        std::vector<std::exception_ptr> errors(count);
+        {
+            // The whole range is queued at once, so that a shut down pool rejects it before any
+            // task refers to this frame
+            std::lock_guard lock(_mutex);
+            if (_stopped)
+            {
+                throw std::runtime_error("Thread pool is shut down");
+            }
+
+            // Each worker gets a contiguous block of the range, the others steal from it once idle
+            for (std::size_t worker = 0; worker < _queues.size(); worker++)
+            {
+                auto &queue = _queues[worker];
+                std::lock_guard queue_lock(queue.mutex);
+                for (std::size_t i = count * worker / _queues.size(); i < count * (worker + 1) / _queues.size(); i++)
+                {
+                    queue.tasks.push_back(
+                        [&function, &done, &errors, i]()
+                        {
+                            try
+                            {
+                                function(i);
+                            }
+                            catch (...)
+                            {
+                                errors[i] = std::current_exception();
+                            }
+
+                            done.count_down();
+                        });
+                }
+            }
+
+            _pending += count;
+        }
+
+        _condition.notify_all();
+        done.wait();
+        for (auto &error : errors)
+        {
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+        }
+    }
+};
+
+thread_local const ThreadPool *ThreadPool::_current_pool = nullptr;
+thread_local std::size_t ThreadPool::_current_index = 0;
@@ -10,6 +10,17 @@ namespace utils
     template <typename _InputIterator>
     using is_input_iterator_t = std::enable_if_t<std::is_convertible_v<_iterator_category_t<_InputIterator>, std::input_iterator_tag>, bool>;
 
+    /**
+     * @brief Mix the bits of a 64-bit integer (the finalizer of SplitMix64).
+     * @see https://prng.di.unimi.it/splitmix64.c
+     */
+    uint64_t hash64(uint64_t value)
+    {
+        value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+        return value ^ (value >> 31);
+    }
+
     /**
      * @brief Format a string with C specifiers.
      * @see https://stackoverflow.com/a/26221725
@@ -119,6 +130,28 @@ namespace utils
         return (*ptr & static_cast<char>(0xc0)) == static_cast<char>(0xc0) || (*ptr & static_cast<char>(0x80)) == 0;
     }
 
+    /**
+     * @brief Append the characters of a UTF-8 string, each packed into an integer from its bytes.
+     *
+     * A character is a leading byte followed by its continuation bytes, so that two characters are
+     * equal if and only if their byte sequences are.
+     */
+    void utf8_characters(std::string_view str, std::vector<uint32_t> &characters)
+    {
+        const auto begin = characters.size();
+        for (auto c : str)
+        {
+            if ((c & 0xC0) != 0x80 || characters.size() == begin)
+            {
+                characters.push_back(static_cast<unsigned char>(c));
+            }
+            else
+            {
+                characters.back() = (characters.back() << 8) | static_cast<unsigned char>(c);
+            }
+        }
+    }
+
     /**
      * @brief Check if a character is an uppercase character.
      *
@@ -251,6 +284,35 @@ namespace utils
         return result;
     }
 
+    /**
+     * @brief Parse a memory size, e.g. `512M` -> 536870912
+     *
+     * @param str The string to parse, a number optionally followed by one of `K`, `M`, `G` or `T`
+     * @return The number of bytes
+     */
+    std::size_t parse_memory_size(const std::string &str)
+    {
+        std::size_t end;
+        auto bytes = std::stold(str, &end);
+
+        const std::string units = "KMGT";
+        if (end + 1 == str.size() && units.find(std::toupper(str[end])) != std::string::npos)
+        {
+            bytes *= std::pow(1024.0l, units.find(std::toupper(str[end])) + 1);
+        }
+        else if (end != str.size())
+        {
+            throw std::invalid_argument(format("Invalid memory size \"%s\"", str.c_str()));
+        }
+
+        if (bytes < 0)
+        {
+            throw std::invalid_argument(format("Invalid memory size \"%s\"", str.c_str()));
+        }
+
+        return static_cast<std::size_t>(bytes);
+    }
+
     long long get_file_size(const std::string &filename)
     {
         struct stat64 stat_buf;
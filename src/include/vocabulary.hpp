@@ -0,0 +1,142 @@
+#pragma once
+
+#include "utils.hpp"
+
+/**
+ * @brief An interned set of tokens, mapping each of them to a dense index in order of insertion.
+ *
+ * The bytes of all tokens are stored contiguously in a single arena, indexed by an offsets array.
+ * Lookup by `std::string_view` goes through an open-addressing table of indices, so that it never
+ * allocates.
+ */
+class Vocabulary
+{
+private:
+    static constexpr uint32_t EMPTY = std::numeric_limits<uint32_t>::max();
+
+    struct _Slot
+    {
+        uint32_t index;
+        uint32_t tag; // The high bits of the hash, to skip most string comparisons
+    };
+
+    std::vector<char> _bytes;
+    std::vector<std::size_t> _offsets = {0};
+    std::vector<_Slot> _slots;
+
+    static uint64_t _hash(std::string_view token)
+    {
+        return std::hash<std::string_view>{}(token);
+    }
+
+    /**
+     * @brief Find the slot holding `token`, or the empty slot where it would be inserted.
+     */
+    std::size_t _probe(std::string_view token, uint64_t hash) const
+    {
+        const auto mask = _slots.size() - 1;
+        const auto tag = static_cast<uint32_t>(hash >> 32);
+
+        auto index = hash & mask;
+        while (_slots[index].index != EMPTY && (_slots[index].tag != tag || (*this)[_slots[index].index] != token))
+        {
+            index = (index + 1) & mask;
+        }
+
+        return index;
+    }
+
+    void _rehash(std::size_t capacity)
+    {
+        _slots.assign(capacity, _Slot{EMPTY, 0});
+        for (uint32_t i = 0; i < size(); i++)
+        {
+            auto token = (*this)[i];
+            auto hash = _hash(token);
+            _slots[_probe(token, hash)] = _Slot{i, static_cast<uint32_t>(hash >> 32)};
+        }
+    }
+
+public:
+    Vocabulary() = default;
+
+    std::size_t size() const
+    {
+        return _offsets.size() - 1;
+    }
+
+    /**
+     * @brief Get a token by its index. The view is invalidated by the next insertion.
+     */
+    std::string_view operator[](std::size_t index) const
+    {
+        return std::string_view(_bytes.data() + _offsets[index], _offsets[index + 1] - _offsets[index]);
+    }
+
+    /**
+     * @brief Allocate enough space for `size` tokens without growing the lookup table.
+     */
+    void reserve(std::size_t size)
+    {
+        _offsets.reserve(size + 1);
+
+        auto capacity = std::bit_ceil(std::max<std::size_t>(16, size + size / 3 + 1));
+        if (capacity > _slots.size())
+        {
+            _rehash(capacity);
+        }
+    }
+
+    /**
+     * @brief Find the index of a token.
+     */
+    std::optional<uint32_t> find(std::string_view token) const
+    {
+        if (_slots.empty())
+        {
+            return std::nullopt;
+        }
+
+        auto slot = _slots[_probe(token, _hash(token))];
+        if (slot.index == EMPTY)
+        {
+            return std::nullopt;
+        }
+
+        return slot.index;
+    }
+
+    /**
+     * @brief Get the index of a token, inserting it if it is not present yet.
+     */
+    uint32_t intern(std::string_view token)
+    {
+        if ((size() + 1) * 4 > _slots.size() * 3)
+        {
+            _rehash(std::max<std::size_t>(16, 2 * _slots.size()));
+        }
+
+        const auto hash = _hash(token);
+        auto &slot = _slots[_probe(token, hash)];
+        if (slot.index == EMPTY)
+        {
+            if (size() >= EMPTY)
+            {
+                throw std::overflow_error("Too many tokens in vocabulary");
+            }
+
+            slot = _Slot{static_cast<uint32_t>(size()), static_cast<uint32_t>(hash >> 32)};
+
+            // `token` may be a view into the arena, which is about to be reallocated
+            const auto offset = _bytes.size();
+            const auto aliased = !std::less<>{}(token.data(), _bytes.data()) && std::less<>{}(token.data(), _bytes.data() + offset);
+            const auto source = aliased ? token.data() - _bytes.data() : 0;
+
+            _bytes.resize(offset + token.size());
+            std::memcpy(_bytes.data() + offset, aliased ? _bytes.data() + source : token.data(), token.size());
+            _offsets.push_back(_bytes.size());
+        }
+
+        return slot.index;
+    }
+};
@@ -1,5 +1,9 @@
+#include <corpus.hpp>
 #include <data.hpp>
+#include <decompress.hpp>
 #include <distance.hpp>
+#include <mapped_file.hpp>
+#include <model.hpp>
 #include <utils.hpp>
 
 class Namespace
@@ -7,11 +11,22 @@ class Namespace
 private:
     static char _default_corpus_path[];
     static char _default_frequency_path[];
+    static char _default_wordlist_path[];
+    static char _default_model_path[];
 
 public:
     char *corpus_path = _default_corpus_path,
-         *frequency_path = _default_frequency_path;
+         *frequency_path = _default_frequency_path,
+         *wordlist_path = _default_wordlist_path,
+         *model_path = _default_model_path,
+         *base_path = nullptr;
 
+    std::size_t threads = 1;
+    std::size_t approximate = 0;
+    std::size_t memory_limit = 0;
+    std::size_t delete_distance = 2;
+    std::size_t confusion_distance = 0;
+    std::filesystem::path temp_directory = std::filesystem::temp_directory_path();
     bool verbose = false;
 
     Namespace(int argc, char **argv)
@@ -40,6 +55,109 @@ public:
                     throw std::out_of_range("Expected path to frequency file after \"--frequency\"");
                 }
             }
+            else if (std::strcmp(argv[i], "--wordlist") == 0)
+            {
+                if (++i < argc)
+                {
+                    wordlist_path = argv[i];
+                }
+                else
+                {
+                    throw std::out_of_range("Expected path to wordlist file after \"--wordlist\"");
+                }
+            }
+            else if (std::strcmp(argv[i], "--model") == 0)
+            {
+                if (++i < argc)
+                {
+                    model_path = argv[i];
+                }
+                else
+                {
+                    throw std::out_of_range("Expected path to model file after \"--model\"");
+                }
+            }
+            else if (std::strcmp(argv[i], "--base") == 0)
+            {
+                if (++i < argc)
+                {
+                    base_path = argv[i];
+                }
+                else
+                {
+                    throw std::out_of_range("Expected path to base model after \"--base\"");
+                }
+            }
+            else if (std::strcmp(argv[i], "--threads") == 0)
+            {
+                if (++i < argc)
+                {
+                    threads = std::stoul(argv[i]);
+                    if (threads == 0)
+                    {
+                        throw std::invalid_argument("Number of threads must be positive");
+                    }
+                }
+                else
+                {
+                    throw std::out_of_range("Expected number of threads after \"--threads\"");
+                }
+            }
+            else if (std::strcmp(argv[i], "--approximate") == 0)
+            {
+                if (++i < argc)
+                {
+                    approximate = utils::parse_memory_size(argv[i]);
+                }
+                else
+                {
+                    throw std::out_of_range("Expected memory budget of approximate counting after \"--approximate\"");
+                }
+            }
+            else if (std::strcmp(argv[i], "--memory-limit") == 0)
+            {
+                if (++i < argc)
+                {
+                    memory_limit = utils::parse_memory_size(argv[i]);
+                }
+                else
+                {
+                    throw std::out_of_range("Expected memory limit after \"--memory-limit\"");
+                }
+            }
+            else if (std::strcmp(argv[i], "--delete-distance") == 0)
+            {
+                if (++i < argc)
+                {
+                    delete_distance = std::stoul(argv[i]);
+                }
+                else
+                {
+                    throw std::out_of_range("Expected maximum distance of the delete index after \"--delete-distance\"");
+                }
+            }
+            else if (std::strcmp(argv[i], "--confusion-distance") == 0)
+            {
+                if (++i < argc)
+                {
+                    confusion_distance = std::stoul(argv[i]);
+                }
+                else
+                {
+                    throw std::out_of_range("Expected maximum distance of the confusion sets after \"--confusion-distance\"");
+                }
+            }
+            else if (std::strcmp(argv[i], "--temp-dir") == 0)
+            {
+                if (++i < argc)
+                {
+                    temp_directory = argv[i];
+                }
+                else
+                {
+                    throw std::out_of_range("Expected path to temporary directory after \"--temp-dir\"");
+                }
+            }
             else if (std::strcmp(argv[i], "-v") == 0)
             {
                 verbose = true;
@@ -49,11 +167,18 @@ public:
                 throw std::invalid_argument(utils::format("Unrecognized argument \"%s\"", argv[i]));
             }
         }
+
+        if (approximate > 0 && memory_limit > 0)
+        {
+            throw std::invalid_argument("\"--approximate\" and \"--memory-limit\" cannot be used together");
+        }
     }
 };
 
 char Namespace::_default_corpus_path[] = "data/corpus.txt";
 char Namespace::_default_frequency_path[] = "data/frequency.txt";
+char Namespace::_default_wordlist_path[] = "data/wordlist.txt";
+char Namespace::_default_model_path[] = "data/model.bin";
 
 namespace std
 {
@@ -63,123 +188,284 @@ namespace std
         stream << "Namespace(";
         stream << "corpus_path=\"" << argparse.corpus_path << "\", ";
         stream << "frequency_path=\"" << argparse.frequency_path << "\", ";
+        stream << "wordlist_path=\"" << argparse.wordlist_path << "\", ";
+        stream << "model_path=\"" << argparse.model_path << "\", ";
+        stream << "base_path=" << (argparse.base_path == nullptr ? "None" : utils::format("\"%s\"", argparse.base_path)) << ", ";
+        stream << "threads=" << argparse.threads << ", ";
+        stream << "approximate=" << argparse.approximate << ", ";
+        stream << "memory_limit=" << argparse.memory_limit << ", ";
+        stream << "delete_distance=" << argparse.delete_distance << ", ";
+        stream << "confusion_distance=" << argparse.confusion_distance << ", ";
+        stream << "temp_directory=" << argparse.temp_directory << ", ";
         stream << "verbose=" << argparse.verbose << ")";
 
         return stream;
     }
 }
 
-int main(int argc, char **argv)
+int learn(int argc, char **argv)
 {
-    std::ios_base::sync_with_stdio(false);
-
     Namespace argparse(argc, argv);
     std::cout << "Command line arguments: " << argparse << std::endl;
 
-    std::unordered_map<std::string, uint32_t> token_map;
-    token_map.reserve(1 << 24);
+    // Flat tables grow cheaply, so a large reservation would only cost memory up front
+    std::size_t reserve = 1 << 20;
 
-    std::unordered_map<uint64_t, unsigned int> frequency;
-    frequency.reserve(1 << 24);
-
-    std::istream *input_ptr;
-    std::fstream file_input;
-    if (std::strcmp(argparse.corpus_path, "-") == 0)
+    // In approximate mode, only bigrams admitted by the sketch are stored exactly. Once the sketch
+    // saturates every bigram is admitted, so the admitted tables get the rest of the budget and
+    // spill like in external-memory mode.
+    std::unique_ptr<CountMinSketch> sketch;
+    std::size_t table_budget = argparse.memory_limit;
+    if (argparse.approximate > 0)
     {
-        input_ptr = &std::cin;
+        sketch = std::make_unique<CountMinSketch>(argparse.approximate / 2);
+        table_budget = argparse.approximate - sketch->memory();
+
+        std::cout << "Approximate counting with a sketch of " << utils::memory_size(sketch->memory()) << " and tables of " << utils::memory_size(table_budget) << std::endl;
     }
-    else
+
+    // Compressed corpora and stdin are streamed, other files are memory-mapped and split between threads
+    const bool streamed = std::strcmp(argparse.corpus_path, "-") == 0 || detect_file_compression(argparse.corpus_path) != Compression::NONE;
+
+    // In external-memory mode, each counter spills its table to disk once it reaches its share of
+    // the memory limit. A `FlatMap` takes at most 64 bytes per entry, while doubling its capacity.
+    // The main counter that shards are merged into holds a table of its own.
+    std::size_t spill_limit = 0;
+    if (table_budget > 0)
     {
-        file_input.open(argparse.corpus_path, std::ios::in);
-        input_ptr = &file_input;
-    }
+        const auto counters = streamed ? 1 : argparse.threads + 1;
+        spill_limit = table_budget / (64 * counters);
+        reserve = std::min(reserve, spill_limit);
 
-    std::string token;
-    std::vector<uint32_t> tokens;
+        std::cout << "Spilling to " << argparse.temp_directory << " every " << spill_limit << " tuples per counter (" << counters << " counters)" << std::endl;
+    }
 
-    const auto process_tokens = [&]()
+    const auto make_counter = [&](std::size_t reserve)
     {
-        const auto size = tokens.size();
-        for (std::size_t i = 0; i + 1 < size; i++)
+        auto counter = std::make_unique<CorpusCounter>(reserve, sketch.get());
+        if (spill_limit > 0)
         {
-            auto mask = (static_cast<uint64_t>(tokens[i]) << 32) | tokens[i + 1];
-            frequency[mask]++;
+            counter->spill_to(spill_limit, argparse.temp_directory);
         }
 
-        tokens.clear();
+        return counter;
     };
 
+    auto corpus_ptr = make_counter(reserve);
+    auto &corpus = *corpus_ptr;
+    auto &frequency = corpus.frequency;
+
+    // Start from the counts of an existing model, so that only the new corpus has to be read.
+    // Tokens of the base model keep their indices.
+    if (argparse.base_path != nullptr)
+    {
+        std::cout << "Loading base model from \"" << argparse.base_path << "\"..." << std::endl;
+        if (is_model_file(argparse.base_path))
+        {
+            Model base(argparse.base_path);
+            for (std::size_t i = 0; i < base.tokens.size(); i++)
+            {
+                corpus.add_token(base.tokens[i]);
+            }
+
+            for (std::size_t i = 0; i < base.tokens.size(); i++)
+            {
+                const auto successors = base.successors(i);
+                for (std::size_t j = 0; j < successors.tokens.size(); j++)
+                {
+                    corpus.add_frequency((static_cast<uint64_t>(i) << 32) | successors.tokens[j], successors.counts[j]);
+                }
+            }
+        }
+        else
+        {
+            Vocabulary base_vocabulary;
+            std::vector<std::pair<uint64_t, unsigned int>> base_tuples;
+            read_frequency(argparse.base_path, base_vocabulary, base_tuples, argparse.threads);
+
+            for (std::size_t i = 0; i < base_vocabulary.size(); i++)
+            {
+                corpus.add_token(base_vocabulary[i]);
+            }
+
+            for (const auto &[mask, freq] : base_tuples)
+            {
+                corpus.add_frequency(mask, freq);
+            }
+        }
+
+        std::cout << "Loaded " << corpus.vocabulary.size() << " tokens and " << frequency.size() << " tuples" << std::endl;
+    }
+
     const auto time_offset = std::chrono::high_resolution_clock::now();
-    unsigned long long counter = 0;
-    while (*input_ptr >> token)
+    const auto report_progress = [&](long long size, const std::string &suffix)
     {
-        // `token` has at least 1 character
-        bool first_valid = is_tokenizable_char(token.front());
-        bool mid_valid = std::all_of(token.begin() + 1, token.end() - 1, is_tokenizable_char);
-        bool last_valid = is_tokenizable_char(token.back());
+        auto speed = 1e6l * size;
+        speed /= std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - time_offset).count();
 
-        auto mask = (first_valid << 2) | (mid_valid << 1) | last_valid;
-        // std::cerr << "Examining \"" << token << "\", mask = " << first_valid << mid_valid << last_valid << std::endl;
-        if (mask == 0b111)
+        std::cout << "Reading corpus: " << utils::memory_size(size);
+        std::cout << " (" << utils::memory_size(speed) << "/s, " << suffix << ")      \r" << std::flush;
+    };
+
+    if (!streamed)
+    {
+        MappedFile corpus_file(argparse.corpus_path, MADV_SEQUENTIAL);
+        const auto boundaries = split_corpus(corpus_file.view(), argparse.threads);
+
+        std::vector<std::unique_ptr<CorpusCounter>> shards;
+        std::vector<std::thread> workers;
+        std::atomic<long long> progress = 0;
+        std::atomic<std::size_t> finished = 0;
+        for (std::size_t i = 0; i < argparse.threads; i++)
         {
-            utils::to_lower(token);
-            tokens.push_back(tokenize(token, token_map));
+            shards.push_back(make_counter(reserve / argparse.threads));
+            workers.emplace_back(
+                [&, i]()
+                {
+                    count_corpus_range(
+                        corpus_file.view().substr(boundaries[i], boundaries[i + 1] - boundaries[i]),
+                        *shards[i],
+                        progress);
+                    finished++;
+                });
         }
-        else if (mask == 0b011)
+
+        while (argparse.verbose && finished < argparse.threads)
+        {
+            report_progress(progress, utils::format("%zu threads", argparse.threads));
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+
+        for (std::size_t i = 0; i < argparse.threads; i++)
         {
-            process_tokens();
+            workers[i].join();
 
-            utils::to_lower(token);
-            tokens.push_back(tokenize(token.substr(1), token_map));
+            // Shards must be merged in order
+            corpus.merge(*shards[i]);
+            shards[i].reset();
         }
-        else
+    }
+    else
+    {
+        if (argparse.threads > 1)
         {
-            if (mask == 0b110)
+            std::cout << "Streaming corpus, ignoring \"--threads\"" << std::endl;
+        }
+
+        // Decompression runs on the pipeline thread of the reader
+        StreamReader reader(argparse.corpus_path);
+        std::atomic<long long> progress = 0;
+        std::atomic<bool> finished = false;
+        std::exception_ptr error;
+        std::thread worker(
+            [&]()
             {
-                token.pop_back();
-                utils::to_lower(token);
+                // Decompression errors are rethrown by the reader on this thread
+                try
+                {
+                    count_corpus_stream(reader, corpus, progress);
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+                }
 
-                tokens.push_back(tokenize(token, token_map));
-            }
+                finished = true;
+            });
 
-            process_tokens();
+        while (argparse.verbose && !finished)
+        {
+            report_progress(progress, "streaming");
+            std::this_thread::sleep_for(std::chrono::seconds(1));
         }
 
-        if (argparse.verbose && !(++counter & 0xFFFFF))
+        worker.join();
+        if (error)
         {
-            const auto size = input_ptr->tellg();
-            auto speed = 1e6l * size;
-            speed /= std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - time_offset).count();
+            std::rethrow_exception(error);
+        }
+    }
+
+    if (sketch != nullptr)
+    {
+        const auto total = sketch->total();
+        std::cout << "\nCount-Min sketch: epsilon = " << sketch->epsilon() << ", delta = " << sketch->delta() << ", " << total << " tuples counted" << std::endl;
+        std::cout << "No tuple with a count of at least " << FREQUENCY_THRESHOLD << " is dropped. With probability at least " << 1.0 - sketch->delta();
+        std::cout << ", each count exceeds the true one by at most " << sketch->epsilon() * total << std::endl;
 
-            std::cout << "Reading corpus: " << utils::memory_size(size);
-            std::cout << " (" << utils::memory_size(speed) << "/s, tuple count = " << frequency.size() << ")      \r" << std::flush;
+        // Estimates below the threshold keep bigrams out of the tables only while `epsilon * N` is small
+        if (sketch->epsilon() * total >= FREQUENCY_THRESHOLD)
+        {
+            std::cout << "Warning: the sketch is saturated, so rare bigrams may have been admitted and spilled to disk as well. A larger budget spills less." << std::endl;
         }
+
+        std::cout << "Memory of bigram counting was bounded by " << utils::memory_size(sketch->memory() + table_budget) << std::endl;
     }
-    std::erase_if(
-        frequency,
-        [](const std::pair<uint64_t, unsigned int> &p)
-        { return p.second < 4; });
 
-    std::cout << "\nSaving " << frequency.size() << " tuples to \"" << argparse.frequency_path << "\"..." << std::endl;
+    // Sort the tuples so that the output does not depend on the number of threads
+    std::vector<std::pair<uint64_t, unsigned int>> tuples;
+    if (spill_limit > 0)
+    {
+        std::cout << "\nMerging " << corpus.runs.size() + !frequency.empty() << " runs..." << std::endl;
+        tuples = corpus.merge_spilled();
+    }
+    else
+    {
+        erase_if(
+            frequency,
+            [](const std::pair<uint64_t, unsigned int> &p)
+            { return p.second < FREQUENCY_THRESHOLD; });
+
+        tuples.assign(frequency.begin(), frequency.end());
+        frequency.clear();
+        std::sort(tuples.begin(), tuples.end());
+    }
+
+    std::cout << "\nSaving " << tuples.size() << " tuples to \"" << argparse.frequency_path << "\"..." << std::endl;
 
-    std::vector<std::string> reversed_token_map;
-    index_tokens(token_map, reversed_token_map);
+    const auto &vocabulary = corpus.vocabulary;
 
     std::fstream frequency_output(argparse.frequency_path, std::ios::out);
-    for (auto &[mask, freq] : frequency)
+    for (auto &[mask, freq] : tuples)
     {
         auto first = mask >> 32, second = mask & 0xFFFFFFFF;
-        frequency_output << reversed_token_map[first] << ' ' << reversed_token_map[second] << ' ' << freq << '\n';
+        frequency_output << vocabulary[first] << ' ' << vocabulary[second] << ' ' << freq << '\n';
     }
 
     frequency_output.close();
 
+    // Tokens without any bigram are unknown to a model loaded from the frequency file as well
+    const auto model_vocabulary = compact_vocabulary(vocabulary, tuples);
+
+    std::cout << "Saving binary model to \"" << argparse.model_path << "\" (" << model_vocabulary.size() << " tokens)..." << std::endl;
+    build_model(model_vocabulary, tuples, read_wordlist(argparse.wordlist_path), argparse.delete_distance, argparse.confusion_distance).save(argparse.model_path);
+
     auto iter = std::max_element(
-        frequency.begin(), frequency.end(),
+        tuples.begin(), tuples.end(),
         [](const auto &lhs, const auto &rhs)
         { return lhs.second < rhs.second; });
 
-    std::cout << "Most frequent tuple: \"" << reversed_token_map[iter->first >> 32] << ' ' << reversed_token_map[iter->first & 0xFFFFFFFF] << "\" with a count of " << iter->second << std::endl;
+    if (iter != tuples.end())
+    {
+        std::cout << "Most frequent tuple: \"" << model_vocabulary[iter->first >> 32] << ' ' << model_vocabulary[iter->first & 0xFFFFFFFF] << "\" with a count of " << iter->second << std::endl;
+    }
 
     return 0;
 }
+
+int main(int argc, char **argv)
+{
+    std::ios_base::sync_with_stdio(false);
+
+    // Report errors, e.g. of a corrupted corpus, without aborting
+    try
+    {
+        return learn(argc, argv);
+    }
+    catch (std::exception &e)
+    {
+        std::cout << std::flush;
+        std::cerr << "\nError: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -5,7 +5,7 @@ import asyncio
 import json
 import os
 from pathlib import Path
-from typing import Iterable, Literal, TYPE_CHECKING
+from typing import Iterable, Literal, Optional, TYPE_CHECKING
 
 import uvloop
 from aiohttp import web
@@ -21,9 +21,12 @@ class Namespace(argparse.Namespace):
         option: Literal["server", "input", "benchmark"]
         frequency_path: Path
         wordlist_path: Path
+        model_path: Optional[Path]
         edit_distance_threshold: int
         max_candidates_per_token: int
         edit_penalty_factor: float
+        batch_window: float
+        max_batch_size: int
         verbose: bool
 
 
@@ -42,6 +45,8 @@ def run_server(namespace: Namespace) -> None:
         edit_distance_threshold=namespace.edit_distance_threshold,
         max_candidates_per_token=namespace.max_candidates_per_token,
         edit_penalty_factor=namespace.edit_penalty_factor,
+        batch_window=namespace.batch_window / 1000,
+        max_batch_size=namespace.max_batch_size,
     )
     web.run_app(app)
 
@@ -125,9 +130,12 @@ parser = argparse.ArgumentParser(
 parser.add_argument("-o", "--option", choices=["server", "input", "benchmark"], default="server", help="Start a spell-checking server, read from stdin, or run benchmarking")
 parser.add_argument("-f", "--frequency-path", type=Path, default=ROOT / "data" / "frequency.txt", help="Path to the frequency file")
 parser.add_argument("-w", "--wordlist-path", type=Path, default=ROOT / "data" / "wordlist.txt", help="Path to the wordlist file")
+parser.add_argument("-m", "--model-path", type=Path, help="Path to the binary model file generated by learn.exe, takes precedence over the frequency and wordlist files. Processes started with the same model file share its memory, while each one builds its own model otherwise")
 parser.add_argument("--edit-distance-threshold", type=int, default=2, help="Edit distance threshold")
 parser.add_argument("--max-candidates-per-token", type=int, default=1000, help="Maximum number of candidates per token")
 parser.add_argument("--edit-penalty-factor", type=float, default=0.01, help="Edit penalty factor")
+parser.add_argument("--batch-window", type=float, default=1.0, help="Time window in milliseconds to coalesce server requests into a single batch")
+parser.add_argument("--max-batch-size", type=int, default=64, help="Maximum number of server requests in a single batch, 1 to disable batching")
 parser.add_argument("-v", "--verbose", action="store_true", help="Enable verbose mode")
 
 
@@ -136,10 +144,13 @@ if __name__ == "__main__":
     parser.parse_args(namespace=namespace)
 
     print(namespace)
-    initialize(
-        frequency_path=str(namespace.frequency_path),
-        wordlist_path=str(namespace.wordlist_path),
-    )
+    if namespace.model_path is None:
+        initialize(
+            frequency_path=str(namespace.frequency_path),
+            wordlist_path=str(namespace.wordlist_path),
+        )
+    else:
+        initialize(model_path=str(namespace.model_path))
 
     callbacks = {
         "server": run_server,
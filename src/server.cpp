@@ -0,0 +1,655 @@
+#include <http.hpp>
+#include <inference.hpp>
+#include <utils.hpp>
+
+class Namespace
+{
+private:
+    static char _default_frequency_path[];
+    static char _default_wordlist_path[];
+    static char _default_host[];
+
+public:
+    char *frequency_path = _default_frequency_path,
+         *wordlist_path = _default_wordlist_path,
+         *model_path = nullptr,
+         *host = _default_host;
+
+    uint16_t port = 8080;
+
+    // Each thread of each process runs its own event loop and serves requests inline, so a large
+    // document blocks the other connections of the same thread until it is corrected
+    std::size_t processes = 1;
+    std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    std::size_t max_body_size = 1 << 20;
+
+    Namespace(int argc, char **argv)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            if (std::strcmp(argv[i], "--frequency") == 0)
+            {
+                if (++i < argc)
+                {
+                    frequency_path = argv[i];
+                }
+                else
+                {
+                    throw std::out_of_range("Expected path to frequency file after \"--frequency\"");
+                }
+            }
+            else if (std::strcmp(argv[i], "--wordlist") == 0)
+            {
+                if (++i < argc)
+                {
+                    wordlist_path = argv[i];
+                }
+                else
+                {
+                    throw std::out_of_range("Expected path to wordlist file after \"--wordlist\"");
+                }
+            }
+            else if (std::strcmp(argv[i], "--model") == 0)
+            {
+                if (++i < argc)
+                {
+                    model_path = argv[i];
+                }
+                else
+                {
+                    throw std::out_of_range("Expected path to model file after \"--model\"");
+                }
+            }
+            else if (std::strcmp(argv[i], "--host") == 0)
+            {
+                if (++i < argc)
+                {
+                    host = argv[i];
+                }
+                else
+                {
+                    throw std::out_of_range("Expected IPv4 address after \"--host\"");
+                }
+            }
+            else if (std::strcmp(argv[i], "--port") == 0)
+            {
+                if (++i < argc)
+                {
+                    const auto value = std::stoul(argv[i]);
+                    if (value > std::numeric_limits<uint16_t>::max())
+                    {
+                        throw std::invalid_argument(utils::format("Invalid port %lu", value));
+                    }
+
+                    port = value;
+                }
+                else
+                {
+                    throw std::out_of_range("Expected port after \"--port\"");
+                }
+            }
+            else if (std::strcmp(argv[i], "--processes") == 0)
+            {
+                if (++i < argc)
+                {
+                    processes = std::stoul(argv[i]);
+                    if (processes == 0)
+                    {
+                        throw std::invalid_argument("Number of processes must be positive");
+                    }
+                }
+                else
+                {
+                    throw std::out_of_range("Expected number of processes after \"--processes\"");
+                }
+            }
+            else if (std::strcmp(argv[i], "--threads") == 0)
+            {
+                if (++i < argc)
+                {
+                    threads = std::stoul(argv[i]);
+                    if (threads == 0)
+                    {
+                        throw std::invalid_argument("Number of threads must be positive");
+                    }
+                }
+                else
+                {
+                    throw std::out_of_range("Expected number of threads after \"--threads\"");
+                }
+            }
+            else if (std::strcmp(argv[i], "--max-body-size") == 0)
+            {
+                if (++i < argc)
+                {
+                    max_body_size = utils::parse_memory_size(argv[i]);
+                }
+                else
+                {
+                    throw std::out_of_range("Expected maximum size of a request body after \"--max-body-size\"");
+                }
+            }
+            else
+            {
+                throw std::invalid_argument(utils::format("Unrecognized argument \"%s\"", argv[i]));
+            }
+        }
+    }
+};
+
+char Namespace::_default_frequency_path[] = "data/frequency.txt";
+char Namespace::_default_wordlist_path[] = "data/wordlist.txt";
+char Namespace::_default_host[] = "0.0.0.0";
+
+namespace std
+{
+    template <typename CharT>
+    basic_ostream<CharT> &operator<<(basic_ostream<CharT> &stream, const Namespace &argparse)
+    {
+        stream << "Namespace(";
+        stream << "frequency_path=\"" << argparse.frequency_path << "\", ";
+        stream << "wordlist_path=\"" << argparse.wordlist_path << "\", ";
+        stream << "model_path=" << (argparse.model_path == nullptr ? "None" : utils::format("\"%s\"", argparse.model_path)) << ", ";
+        stream << "host=\"" << argparse.host << "\", ";
+        stream << "port=" << argparse.port << ", ";
+        stream << "processes=" << argparse.processes << ", ";
+        stream << "threads=" << argparse.threads << ", ";
+        stream << "max_body_size=" << argparse.max_body_size << ")";
+
+        return stream;
+    }
+}
+
+/**
+ * @brief An eventfd watched by every worker of every process, written to on SIGINT or SIGTERM to
+ * stop the whole server.
+ */
+int stop_event = -1;
+
+void handle_signal(int)
+{
+    const uint64_t one = 1;
+    [[maybe_unused]] auto _ = write(stop_event, &one, sizeof(one));
+}
+
+/**
+ * @brief Open a non-blocking listening socket. Every worker has its own socket bound to the same
+ * port with `SO_REUSEPORT`, so that the kernel balances incoming connections between them.
+ */
+int open_listener(const Namespace &argparse)
+{
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(argparse.port);
+    if (inet_pton(AF_INET, argparse.host, &address.sin_addr) != 1)
+    {
+        throw std::invalid_argument(utils::format("Invalid IPv4 address \"%s\"", argparse.host));
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        throw std::runtime_error(utils::format("Failed to create socket: %s", std::strerror(errno)));
+    }
+
+    const int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1 ||
+        bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1 ||
+        listen(fd, SOMAXCONN) == -1)
+    {
+        const auto error = errno;
+        close(fd);
+        throw std::runtime_error(utils::format("Failed to listen on %s:%u: %s", argparse.host, argparse.port, std::strerror(error)));
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Parse a non-negative form field, with the same validation as `app.py`.
+ */
+template <typename T>
+T form_value(const std::unordered_map<std::string, std::string> &form, const std::string &key)
+{
+    const auto iter = form.find(key);
+    if (iter == form.end())
+    {
+        throw http::HTTPError(400, "Bad Request");
+    }
+
+    const auto value = http::trim(iter->second);
+    T result;
+    const auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), result);
+    if (ec != std::errc() || ptr != value.data() + value.size() || result < 0)
+    {
+        throw http::HTTPError(400, "Bad Request");
+    }
+
+    return result;
+}
+
+/**
+ * @brief Serve a single request, in the same protocol as `app.py`.
+ */
+void handle_request(const http::Request &request, std::string &output)
+{
+    if (request.path != "/api")
+    {
+        throw http::HTTPError(404, "Not Found");
+    }
+
+    if (request.method != "POST")
+    {
+        throw http::HTTPError(405, "Method Not Allowed");
+    }
+
+    const auto form = http::parse_form(request.body);
+    const auto text_iter = form.find("text");
+    if (text_iter == form.end())
+    {
+        throw http::HTTPError(400, "Bad Request");
+    }
+
+    const auto edit_distance_threshold = form_value<long long>(form, "edit_distance_threshold");
+    const auto max_candidates_per_token = form_value<long long>(form, "max_candidates_per_token");
+    const auto edit_penalty_factor = form_value<double>(form, "edit_penalty_factor");
+    if (edit_penalty_factor > 1.0)
+    {
+        throw http::HTTPError(400, "Bad Request");
+    }
+
+    const auto result = inference(text_iter->second, edit_distance_threshold, max_candidates_per_token, edit_penalty_factor);
+    http::write_response(output, 200, "text/plain; charset=utf-8", result, request.keep_alive);
+}
+
+/**
+ * @brief The state of a client connection, owned by a single worker.
+ */
+struct Connection
+{
+    std::string input, output;
+    std::size_t written = 0;
+    bool closing = false;
+    uint32_t events = EPOLLIN | EPOLLRDHUP; // The events the connection is watched for
+};
+
+/**
+ * @brief Read everything available from a client and serve its complete requests.
+ *
+ * @return Whether the connection is still usable.
+ */
+bool receive(int fd, Connection &connection, const Namespace &argparse)
+{
+    bool eof = false;
+    char buffer[1 << 16];
+    while (true)
+    {
+        const auto size = read(fd, buffer, sizeof(buffer));
+        if (size > 0)
+        {
+            connection.input.append(buffer, size);
+        }
+        else if (size == 0)
+        {
+            eof = true;
+            break;
+        }
+        else if (errno == EINTR)
+        {
+            continue;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            break;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    // Pipelined requests are served in order
+    std::size_t offset = 0;
+    while (!connection.closing)
+    {
+        http::Request request;
+        bool parsed = false;
+        try
+        {
+            const auto size = http::parse_request(std::string_view(connection.input).substr(offset), request, argparse.max_body_size);
+            if (size == 0)
+            {
+                break;
+            }
+
+            offset += size;
+            parsed = true;
+            handle_request(request, connection.output);
+            connection.closing = !request.keep_alive;
+        }
+        catch (http::HTTPError &e)
+        {
+            // A request that cannot be parsed leaves the rest of the stream unusable
+            const bool keep_alive = parsed && request.keep_alive;
+            http::write_response(connection.output, e.status, "text/plain; charset=utf-8", utils::format("%d: %s", e.status, e.what()), keep_alive);
+            connection.closing = !keep_alive;
+        }
+        catch (std::exception &e)
+        {
+            http::write_response(connection.output, 500, "text/plain; charset=utf-8", "500: Internal Server Error", request.keep_alive);
+            connection.closing = !request.keep_alive;
+            std::cerr << "Error during inference: " << e.what() << std::endl;
+        }
+    }
+
+    connection.input.erase(0, offset);
+    connection.closing |= eof;
+    return true;
+}
+
+/**
+ * @brief Write as much of the pending output as the socket accepts.
+ *
+ * @return Whether the connection is still usable.
+ */
+bool flush(int fd, Connection &connection)
+{
+    while (connection.written < connection.output.size())
+    {
+        const auto size = send(fd, connection.output.data() + connection.written, connection.output.size() - connection.written, MSG_NOSIGNAL);
+        if (size >= 0)
+        {
+            connection.written += size;
+        }
+        else if (errno == EINTR)
+        {
+            continue;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return true;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    connection.output.clear();
+    connection.written = 0;
+    return !connection.closing;
+}
+
+/**
+ * @brief The event loop of a worker, serving its own listening socket until the server stops.
+ * Requests are served inline, so that each worker only competes with the other ones for the CPU,
+ * at the cost of head-of-line blocking between the connections of a worker.
+ */
+void serve(int listener, const Namespace &argparse)
+{
+    const int epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll == -1)
+    {
+        throw std::runtime_error(utils::format("Failed to create epoll instance: %s", std::strerror(errno)));
+    }
+
+    const auto watch = [epoll](int op, int fd, uint32_t events)
+    {
+        epoll_event event = {};
+        event.events = events;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll, op, fd, &event) == -1)
+        {
+            throw std::runtime_error(utils::format("Failed to watch file descriptor %d: %s", fd, std::strerror(errno)));
+        }
+    };
+
+    watch(EPOLL_CTL_ADD, listener, EPOLLIN);
+    watch(EPOLL_CTL_ADD, stop_event, EPOLLIN);
+
+    // While out of descriptors, pending connections would keep the level-triggered listener ready,
+    // so it is left unwatched for a while instead of being retried in a busy loop
+    constexpr auto ACCEPT_BACKOFF = std::chrono::milliseconds(100);
+    bool accepting = true;
+    std::chrono::steady_clock::time_point resume_accept;
+
+    std::unordered_map<int, Connection> connections;
+    std::array<epoll_event, 256> events;
+    bool running = true;
+    while (running)
+    {
+        int timeout = -1;
+        if (!accepting)
+        {
+            const auto remaining = std::chrono::ceil<std::chrono::milliseconds>(resume_accept - std::chrono::steady_clock::now());
+            timeout = std::max<int>(remaining.count(), 0);
+        }
+
+        const auto count = epoll_wait(epoll, events.data(), events.size(), timeout);
+        if (count == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            throw std::runtime_error(utils::format("Failed to wait for events: %s", std::strerror(errno)));
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            const auto fd = events[i].data.fd;
+            if (fd == stop_event)
+            {
+                running = false;
+            }
+            else if (fd == listener)
+            {
+                int client;
+                while ((client = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+                {
+                    const int one = 1;
+                    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                    try
+                    {
+                        watch(EPOLL_CTL_ADD, client, EPOLLIN | EPOLLRDHUP);
+                        connections.emplace(client, Connection());
+                    }
+                    catch (std::exception &e)
+                    {
+                        std::cerr << "Dropped connection: " << e.what() << std::endl;
+                        close(client);
+                    }
+                }
+
+                if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                {
+                    std::cerr << "Failed to accept connection: " << std::strerror(errno) << std::endl;
+                    watch(EPOLL_CTL_DEL, listener, 0);
+                    accepting = false;
+                    resume_accept = std::chrono::steady_clock::now() + ACCEPT_BACKOFF;
+                }
+            }
+            else
+            {
+                // Connections closed earlier in this batch may still have events
+                const auto found = connections.find(fd);
+                if (found == connections.end())
+                {
+                    continue;
+                }
+
+                auto &connection = found->second;
+                bool alive = true;
+                try
+                {
+                    if (!connection.closing && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+                    {
+                        alive = receive(fd, connection, argparse);
+                    }
+
+                    alive = alive && flush(fd, connection);
+                    if (alive)
+                    {
+                        // Wait for the socket to become writable only while a response is pending. Once
+                        // closing, nothing more is read, and a half-closed peer would keep the level-triggered
+                        // input events ready.
+                        const auto writable = static_cast<uint32_t>(EPOLLOUT);
+                        const uint32_t events = connection.closing
+                                                    ? writable
+                                                    : EPOLLIN | EPOLLRDHUP | (connection.output.empty() ? 0 : writable);
+                        if (events != connection.events)
+                        {
+                            watch(EPOLL_CTL_MOD, fd, events);
+                            connection.events = events;
+                        }
+                    }
+                }
+                catch (std::exception &e)
+                {
+                    // Only this client is dropped, the worker keeps serving the other ones
+                    std::cerr << "Dropped connection: " << e.what() << std::endl;
+                    alive = false;
+                }
+
+                if (!alive)
+                {
+                    // Closing the descriptor removes it from the epoll instance
+                    close(fd);
+                    connections.erase(found);
+                }
+            }
+        }
+
+        if (!accepting && std::chrono::steady_clock::now() >= resume_accept)
+        {
+            watch(EPOLL_CTL_ADD, listener, EPOLLIN);
+            accepting = true;
+        }
+    }
+
+    for (const auto &[fd, _] : connections)
+    {
+        close(fd);
+    }
+
+    close(epoll);
+}
+
+int main(int argc, char **argv)
+{
+    std::ios_base::sync_with_stdio(false);
+
+    Namespace argparse(argc, argv);
+    std::cout << "Command line arguments: " << argparse << std::endl;
+
+    if (argparse.model_path != nullptr)
+    {
+        initialize(std::nullopt, std::nullopt, argparse.model_path);
+    }
+    else
+    {
+        initialize(argparse.frequency_path, argparse.wordlist_path, std::nullopt);
+    }
+
+    stop_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stop_event == -1)
+    {
+        throw std::runtime_error(utils::format("Failed to create eventfd: %s", std::strerror(errno)));
+    }
+
+    std::signal(SIGINT, handle_signal);
+    std::signal(SIGTERM, handle_signal);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    // All sockets are bound before serving, so that the port is checked once
+    std::vector<int> listeners;
+    for (std::size_t i = 0; i < argparse.threads; i++)
+    {
+        listeners.push_back(open_listener(argparse));
+    }
+
+    std::cout << "Serving on http://" << argparse.host << ":" << argparse.port << " with " << argparse.processes << " processes of " << argparse.threads << " threads" << std::endl;
+
+    // Worker processes are forked after the model is loaded, so that they share its pages instead of
+    // loading their own copy. They bind their own sockets to the same port.
+    std::vector<pid_t> children;
+    bool child = false;
+    for (std::size_t i = 1; i < argparse.processes && !child; i++)
+    {
+        const auto pid = fork();
+        if (pid == -1)
+        {
+            std::cerr << "Failed to fork worker process: " << std::strerror(errno) << std::endl;
+            handle_signal(SIGTERM);
+            break;
+        }
+
+        if (pid == 0)
+        {
+            child = true;
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            try
+            {
+                for (auto &listener : listeners)
+                {
+                    close(listener);
+                    listener = open_listener(argparse);
+                }
+            }
+            catch (std::exception &e)
+            {
+                std::cerr << "Worker process stopped: " << e.what() << std::endl;
+                handle_signal(SIGTERM);
+                _exit(1);
+            }
+        }
+        else
+        {
+            children.push_back(pid);
+        }
+    }
+
+    std::vector<std::thread> workers;
+    for (auto listener : listeners)
+    {
+        workers.emplace_back(
+            [listener, &argparse]()
+            {
+                try
+                {
+                    serve(listener, argparse);
+                }
+                catch (std::exception &e)
+                {
+                    std::cerr << "Worker stopped: " << e.what() << std::endl;
+                    handle_signal(SIGTERM);
+                }
+            });
+    }
+
+    for (std::size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+        close(listeners[i]);
+    }
+
+    if (child)
+    {
+        // Static destructors of the parent, e.g. of its parallel algorithm threads, do not apply to a forked process
+        std::cout.flush();
+        _exit(0);
+    }
+
+    for (auto pid : children)
+    {
+        waitpid(pid, nullptr, 0);
+    }
+
+    close(stop_event);
+    std::cout << "Server stopped" << std::endl;
+
+    return 0;
+}